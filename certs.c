@@ -1,4 +1,5 @@
 #define _GNU_SOURCE
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <poll.h>
@@ -8,15 +9,33 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#ifdef linux
+#  include <sys/inotify.h>
+#endif
 #include <openssl/bn.h>
+#include <openssl/ec.h>
 #include <openssl/err.h>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
 #include <openssl/crypto.h> 
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
 #include <openssl/x509v3.h> 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#endif
 
 #include "certs.h"
 #include "logger.h"
@@ -34,6 +53,235 @@ static int sslctx_tbl_size, sslctx_tbl_end;
 static int sslctx_tbl_cnt_hit, sslctx_tbl_cnt_miss, sslctx_tbl_cnt_purge;
 static unsigned int  sslctx_tbl_last_flush;
 
+/* SHARDS-style spatially sampled LRU stack of cert names looked up in
+   sslctx_tbl. Names stay on the stack after being purged from the table,
+   so the stack doubles as a ghost cache and yields reuse distances beyond
+   the current table size. Used to estimate the miss ratio curve. */
+#define MRC_HASH_MOD        (1 << 24) /* sample if (hash % MOD) < threshold */
+#define MRC_MAX_SAMPLES     1024      /* max sampled names on the stack */
+#define MRC_BUCKET_WIDTH    25        /* cache sizes per histogram bucket */
+#define MRC_BUCKETS         160       /* histogram covers sizes up to 4000 */
+#define MRC_EVAL_REFS       1024      /* min lookups between auto-size evaluations */
+#define MRC_MIN_WEIGHT      128       /* min estimated refs before auto-sizing */
+
+static struct {
+    unsigned int *stack;              /* name hashes, most recently used first */
+    int depth;
+    unsigned int threshold;
+    float hist[MRC_BUCKETS + 1];      /* last bucket: beyond histogram range */
+    float cold;                       /* first references i.e. compulsory misses */
+    float total;
+    int refs;                         /* lookups since last evaluation. sslctx_lock */
+    int target;                       /* auto mode: target hit rate in %; 0 off */
+    int max_size;                     /* auto mode: upper bound of table size */
+    pthread_mutex_t lock;
+} mrc;
+
+/* negative cache: cert names recently found missing (cert generation
+   pending) or not usable. Direct mapped; colliding names replace each other */
+static neg_cache_struct neg_tbl[PIXEL_NEG_TBL_SIZE];
+static int neg_tbl_cnt_miss, neg_tbl_cnt_err;
+static pthread_mutex_t neg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* in-memory index of file names in pem_dir. Saves a stat() on flash or USB
+   storage for every cert cache miss. Kept current by the cert generator
+   and, on Linux, by inotify events. */
+static struct {
+    name_tbl files;
+    int ifd; /* inotify fd */
+    const char *pem_dir;
+    pthread_mutex_t lock;
+} cert_idx = { { NULL, 0, 0 }, -1, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+/* optional single-file cert store. Append-only records of DER encoded cert
+   and key, mapped read-only and indexed by cert name. Loading a cert is a
+   DER decode straight from the mapping. */
+static struct {
+    int fd;
+    const unsigned char *map;
+    size_t map_len; /* file size plus headroom, so appends rarely remap */
+    size_t size; /* file size when last indexed */
+    size_t end; /* end of the last valid record */
+    name_tbl idx; /* cert name -> record offset */
+    pthread_rwlock_t lock;
+} cert_store = { -1, NULL, 0, 0, 0, { NULL, 0, 0 }, PTHREAD_RWLOCK_INITIALIZER };
+
+/* second cert cache tier behind sslctx_tbl. Holds only the DER encoded cert
+   and key of entries evicted from sslctx_tbl, a few KB each instead of a
+   full SSL_CTX, in LRU order. Touched by the main thread only, as is
+   sslctx_tbl. */
+static struct {
+    name_tbl idx; /* cert name -> der_cache_struct */
+    der_cache_struct *head, *tail; /* most recently used first */
+    long bytes;
+    long max_bytes;
+    int cnt_hit;
+} der_tbl;
+
+/* sslctx_tbl and der_tbl are mostly used by the main thread. Handshakes
+   suspended for inline cert generation resume in service threads */
+static pthread_mutex_t sslctx_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* inline cert generation: handshakes of missing certs wait up to
+   cert_gen_deadline msec for the cert generator, signalled by gen_cond */
+static int cert_gen_deadline;
+static pthread_mutex_t gen_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gen_cond = PTHREAD_COND_INITIALIZER;
+
+static leaf_key_enum leaf_key_type = LEAF_KEY_RSA;
+static const char *leaf_key_name[] = { "RSA-1024", "ECDSA P-256" };
+
+/* optional leaf key shared by all generated certs. Records in the cert
+   store and the DER tier then omit the key, and PEM files carry the cert
+   only */
+static EVP_PKEY *shared_key;
+
+/* leaf keys generated ahead of time by the cert generator when idle.
+   Issuing a cert then costs building and signing the X509 only */
+static struct {
+    EVP_PKEY **keys;
+    int size, cnt;
+    int cnt_empty;              /* certs issued with the pool empty */
+    unsigned int rate_min;      /* refill rate: current minute of uptime */
+    int rate_cnt;               /* refill rate: keys in current minute */
+    int rate;                   /* refill rate: keys in last minute */
+    pthread_mutex_t lock;
+} key_pool = { NULL, 0, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* names waiting for cert generation, taken by the cert worker threads */
+static struct {
+    gen_queue_struct *heap;
+    int cnt;
+    unsigned int seq;
+    name_tbl names;             /* pending set. queued: heap index. being generated: -1 */
+    int busy;                   /* workers generating a cert */
+    int workers;
+    float lat_avg;              /* msec from queued to generated */
+    int lat_cnt;
+    float lat_max;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} gen_queue = { NULL, 0, 0, { NULL, 0, 0 }, 0, 1, 0, 0, 0,
+                PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+/* Public Suffix List rules, e.g. "co.uk", "*.ck", "!www.ck" */
+static str_set psl;
+
+/* domains that may get certs. NULL: any */
+static struct {
+    str_set *set;
+    char **files;
+    int file_cnt;
+    int reload_pipe[2];         /* SIGHUP to cert_generator */
+    pthread_rwlock_t lock;
+} allowlist = { NULL, NULL, 0, { -1, -1 }, PTHREAD_RWLOCK_INITIALIZER };
+
+/* multi-SAN certs shared by the names listed in PIXEL_BUNDLE_FILE. Loaded
+   on startup and read-only afterwards */
+static struct {
+    bundle_struct list[PIXEL_BUNDLE_MAX];
+    int cnt;
+    name_tbl members;           /* cert name: index in list */
+} bundles;
+
+/* CPU budget of cert generation: thread priority and issuance rate */
+static struct {
+    int nice;                   /* 0: unchanged. PIXEL_GEN_NICE_IDLE: SCHED_IDLE */
+    int rate;                   /* certs per second at kcc 0. 0: unlimited */
+    double tokens;
+    struct timespec last;
+    int cnt_defer;              /* certs that waited for a token */
+    double msec_defer;
+    pthread_mutex_t lock;
+} gen_budget = { 0, 0, 0, { 0, 0 }, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* names answered with our address in the resolver's log */
+static struct {
+    char file[PIXELSERV_MAX_PATH];
+    char addr[PIXEL_DNS_LOG_ADDRS][INET6_ADDRSTRLEN];
+    int addr_cnt;
+    int started;
+    int cnt_warm;               /* certs loaded into sslctx_tbl */
+    int cnt_gen;                /* certs queued for generation */
+} dns_log;
+
+/* optional unix datagram socket for external tools to queue names */
+static struct {
+    int fd;
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+} cert_ctrl = { -1, "" };
+
+/* session ticket keys, in memory only. Shared by g_sslctx and all child
+   SSL_CTXs, so a ticket resumes a session whichever cert it was issued
+   with. keys[0] encrypts new tickets. It is replaced every
+   PIXEL_TICKET_ROTATE_SEC and the older keys still decrypt */
+static struct {
+    ticket_key_struct keys[PIXEL_TICKET_KEYS];
+    int cnt;
+    unsigned int rotated;       /* uptime of last rotation */
+    int cnt_resumed;            /* handshakes resumed from a ticket or the session cache */
+    int cnt_full;               /* the counters are atomic, not under lock */
+    pthread_rwlock_t lock;      /* keys */
+} tickets = { .lock = PTHREAD_RWLOCK_INITIALIZER };
+
+/* external TLS session cache of g_sslctx, sharded by session ID so that
+   handshake threads rarely contend. Each shard keeps its sessions in
+   insertion order: with a fixed timeout that is also the expiry order, so
+   expired sessions are dropped from the head a few at a time on access,
+   as are the oldest ones when a shard is over its share of memory */
+static sess_shard_struct sess_shards[PIXEL_SESS_SHARDS];
+
+/* certs listed in pem_dir/prefetch, loaded into sslctx_tbl by background
+   threads after startup */
+static struct {
+    prefetch_struct *list;      /* highest reuse_count first */
+    int cnt, next;
+    int loaded;
+    int threads;                /* warm-up threads still running */
+    const char *pem_dir;
+    const STACK_OF(X509_INFO) *cachain;
+    struct timespec start;
+    pthread_mutex_t lock;
+} prefetch = { NULL, 0, 0, 0, 0, NULL, NULL, { 0, 0 }, PTHREAD_MUTEX_INITIALIZER };
+
+/* warm-up threads of the admin 'warm=' request */
+static struct {
+    int threads;                /* at most PIXEL_ADMIN_WARM_THREADS */
+    pthread_mutex_t lock;
+} admin_warm = { 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* periodic checkpoint of the cache ranking and cert usage. SIGUSR1 asks
+   for one through the pipe */
+static struct {
+    int pipe[2];
+    pthread_mutex_t file_lock;  /* rewrites of pem_dir/prefetch, also by GC */
+} checkpoint = { { -1, -1 }, PTHREAD_MUTEX_INITIALIZER };
+
+/* write-behind: new certs go to a private staging dir in RAM,
+   and are moved into CERT_PATH in batches by cert_stage_flusher once
+   delay seconds old. Spares flash storage the bursts of issuance */
+static struct {
+    int delay;                  /* seconds. 0: write straight to CERT_PATH */
+    char *dir;
+    name_tbl names;             /* staged cert name: uptime when staged */
+    int cnt_flushed;
+    pthread_mutex_t lock;       /* names and the files in dir */
+    pthread_mutex_t flush_lock;
+} cert_stage = { 0, NULL, { NULL, 0, 0 }, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
+/* last use and hits of every cert in CERT_PATH, kept in PIXEL_USAGE_FILE
+   across restarts. Certs unused for gc_days are deleted or archived */
+static struct {
+    name_tbl names;             /* cert name: usage_struct */
+    int dirty;
+    int gc_days;                /* 0: no GC */
+    int gc_archive;             /* move to PIXEL_ARCHIVE_DIR instead of deleting */
+    time_t last_gc;
+    int cnt_gc;
+    pthread_mutex_t lock;       /* names. Taken in the handshake path */
+    pthread_mutex_t save_lock;  /* PIXEL_USAGE_FILE */
+} usage = { { NULL, 0, 0 }, 0, 0, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER };
+
 static void **conn_stor;
 static int conn_stor_last = -1, conn_stor_max = -1;
 static pthread_mutex_t cslock;
@@ -46,13 +294,361 @@ inline int sslctx_tbl_get_cnt_total() { return sslctx_tbl_end; }
 inline int sslctx_tbl_get_cnt_hit() { return sslctx_tbl_cnt_hit; }
 inline int sslctx_tbl_get_cnt_miss() { return sslctx_tbl_cnt_miss; }
 inline int sslctx_tbl_get_cnt_purge() { return sslctx_tbl_cnt_purge; }
-inline int sslctx_tbl_get_sess_cnt() { return SSL_CTX_sess_number(g_sslctx); }
-inline int sslctx_tbl_get_sess_hit() { return SSL_CTX_sess_hits(g_sslctx); }
-inline int sslctx_tbl_get_sess_miss() { return SSL_CTX_sess_misses(g_sslctx); }
-inline int sslctx_tbl_get_sess_purge() { return SSL_CTX_sess_cache_full(g_sslctx); }
+inline int der_tbl_get_cnt_total() { return der_tbl.idx.cnt; }
+inline int der_tbl_get_cnt_hit() { return der_tbl.cnt_hit; }
+inline int der_tbl_get_kb() { return der_tbl.bytes / 1024; }
+inline int key_pool_get_cnt() { return key_pool.cnt; }
+inline int key_pool_get_cnt_empty() { return key_pool.cnt_empty; }
+int key_pool_get_rate()
+{
+    /* keys in the last full minute of uptime */
+    return (process_uptime() / 60 == key_pool.rate_min + 1) ? key_pool.rate_cnt :
+        (process_uptime() / 60 == key_pool.rate_min) ? key_pool.rate : 0;
+}
+int dns_log_get_cnt_warm() { return dns_log.cnt_warm; }
+int dns_log_get_cnt_gen() { return dns_log.cnt_gen; }
+int gen_budget_get_cnt_defer() { return gen_budget.cnt_defer; }
+int gen_budget_get_sec_defer() { return gen_budget.msec_defer / 1000 + 0.5; }
+int cert_stage_get_cnt() { return cert_stage.names.cnt; }
+int cert_stage_get_cnt_flushed() { return cert_stage.cnt_flushed; }
+int usage_get_cnt() { return usage.names.cnt; }
+int usage_get_cnt_gc() { return usage.cnt_gc; }
+int gen_queue_get_cnt() { return gen_queue.cnt + gen_queue.busy; }
+int gen_queue_get_lat_avg() { return gen_queue.lat_avg + 0.5; }
+int gen_queue_get_lat_max() { return gen_queue.lat_max + 0.5; }
+inline int neg_tbl_get_cnt_miss() { return neg_tbl_cnt_miss; }
+inline int neg_tbl_get_cnt_err() { return neg_tbl_cnt_err; }
+int sslctx_tbl_get_sess_cnt()
+{
+    int idx, cnt = 0;
+    for (idx = 0; idx < PIXEL_SESS_SHARDS; idx++)
+        cnt += sess_shards[idx].cnt;
+    return cnt;
+}
+int sslctx_tbl_get_sess_purge()
+{
+    int idx, cnt = 0;
+    for (idx = 0; idx < PIXEL_SESS_SHARDS; idx++)
+        cnt += sess_shards[idx].cnt_evict;
+    return cnt;
+}
+inline int sslctx_tbl_get_sess_hit() { return tickets.cnt_resumed; }
+inline int sslctx_tbl_get_sess_miss() { return tickets.cnt_full; }
 
 static int sslctx_tbl_insert(const char *cert_name, SSL_CTX *sslctx, int ins_idx);
-static SSL_CTX* create_child_sslctx(const char* full_pem_path, const STACK_OF(X509_INFO) *cachain);
+static int cmp_sslctx_certname(const void *k, const void *p);
+static unsigned int sess_hash(const unsigned char *id, unsigned int idlen)
+{
+    unsigned int h = 2166136261u, i; /* FNV-1a */
+    for (i = 0; i < idlen; i++)
+        h = (h ^ id[i]) * 16777619u;
+    return h;
+}
+
+static sess_entry_struct **sess_bucket(const unsigned char *id, unsigned int idlen, sess_shard_struct **shard)
+{
+    unsigned int h = sess_hash(id, idlen);
+    *shard = &sess_shards[h % PIXEL_SESS_SHARDS];
+    return &(*shard)->bucket[(h / PIXEL_SESS_SHARDS) % PIXEL_SESS_BUCKETS];
+}
+
+/* entry of session id in bucket. Caller holds the shard lock */
+static sess_entry_struct *sess_find(sess_entry_struct *e, const unsigned char *id, unsigned int idlen)
+{
+    for (; e && (e->idlen != idlen || memcmp(e->id, id, idlen)); e = e->hnext);
+    return e;
+}
+
+/* unlink e from its shard. Caller holds the shard lock and frees e */
+static void sess_unlink(sess_shard_struct *shard, sess_entry_struct *e)
+{
+    sess_entry_struct **pp = &shard->bucket[(sess_hash(e->id, e->idlen) / PIXEL_SESS_SHARDS) % PIXEL_SESS_BUCKETS];
+
+    for (; *pp && *pp != e; pp = &(*pp)->hnext);
+    if (*pp)
+        *pp = e->hnext;
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        shard->head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        shard->tail = e->prev;
+    shard->cnt--;
+    shard->bytes -= e->bytes;
+}
+
+/* drop up to max expired sessions from the head, all if max < 0, then the
+   oldest ones while over budget. Returns the list of dropped entries */
+static sess_entry_struct *sess_expire(sess_shard_struct *shard, time_t now, int max, int budget)
+{
+    sess_entry_struct *e, *gone = NULL;
+
+    while ((e = shard->head) != NULL && ((e->expire <= now && max-- != 0) || shard->bytes > budget)) {
+        if (e->expire <= now)
+            shard->cnt_expire++;
+        else
+            shard->cnt_evict++;
+        sess_unlink(shard, e);
+        e->hnext = gone;
+        gone = e;
+    }
+    return gone;
+}
+
+static void sess_free_list(sess_entry_struct *e)
+{
+    sess_entry_struct *next;
+    for (; e; e = next) {
+        next = e->hnext;
+        SSL_SESSION_free(e->sess);
+        free(e);
+    }
+}
+
+static int new_session(SSL *ssl, SSL_SESSION *sess)
+{
+    sess_shard_struct *shard;
+    sess_entry_struct **bucket, *e, *gone = NULL;
+    const unsigned char *id;
+    unsigned int idlen;
+
+    id = SSL_SESSION_get_id(sess, &idlen);
+    if (idlen == 0 || idlen > SSL_MAX_SSL_SESSION_ID_LENGTH || (e = calloc(1, sizeof(*e))) == NULL)
+        return 0;
+    memcpy(e->id, id, idlen);
+    e->idlen = idlen;
+    e->sess = sess;
+    e->expire = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+    e->bytes = sizeof(*e) + PIXEL_SESS_BASE_SIZE + i2d_SSL_SESSION(sess, NULL);
+
+    bucket = sess_bucket(id, idlen, &shard);
+    pthread_mutex_lock(&shard->lock);
+    gone = sess_expire(shard, time(NULL), PIXEL_SESS_EXPIRE_STEP,
+                       PIXEL_SESS_CACHE_KB * 1024 / PIXEL_SESS_SHARDS - e->bytes);
+    e->hnext = *bucket;
+    *bucket = e;
+    e->prev = shard->tail;
+    if (shard->tail)
+        shard->tail->next = e;
+    else
+        shard->head = e;
+    shard->tail = e;
+    shard->cnt++;
+    shard->bytes += e->bytes;
+    pthread_mutex_unlock(&shard->lock);
+    sess_free_list(gone);
+    return 1; /* keep the reference */
+}
+
+static void remove_session(SSL_CTX *sslctx, SSL_SESSION *sess)
+{
+    sess_shard_struct *shard;
+    sess_entry_struct **bucket, *e;
+    const unsigned char *id;
+    unsigned int idlen;
+
+    id = SSL_SESSION_get_id(sess, &idlen);
+    bucket = sess_bucket(id, idlen, &shard);
+    pthread_mutex_lock(&shard->lock);
+    if ((e = sess_find(*bucket, id, idlen)) != NULL)
+        sess_unlink(shard, e);
+    pthread_mutex_unlock(&shard->lock);
+    if (e) {
+        e->hnext = NULL;
+        sess_free_list(e);
+    }
+}
+
+static SSL_SESSION *get_session(SSL *ssl, const unsigned char *id, int idlen, int *do_copy)
+{
+    sess_shard_struct *shard;
+    sess_entry_struct **bucket, *e, *gone;
+    SSL_SESSION *sess = NULL;
+    time_t now = time(NULL);
+
+    *do_copy = 0; /* the returned reference is taken for the caller */
+    bucket = sess_bucket(id, idlen, &shard);
+    pthread_mutex_lock(&shard->lock);
+    gone = sess_expire(shard, now, PIXEL_SESS_EXPIRE_STEP, PIXEL_SESS_CACHE_KB * 1024 / PIXEL_SESS_SHARDS);
+    e = sess_find(*bucket, id, idlen);
+    if (e && e->expire > now && SSL_SESSION_up_ref(e->sess)) {
+        sess = e->sess;
+        shard->cnt_hit++;
+    } else
+        shard->cnt_miss++;
+    pthread_mutex_unlock(&shard->lock);
+    sess_free_list(gone);
+    return sess;
+}
+
+#ifdef TLS1_3_VERSION
+/* anti-replay for 0-RTT, in place of OpenSSL's own that needs its internal
+   cache: early data is accepted once per session issued with a ticket,
+   while the session is still in the cache */
+static int tls_early_data_cb(SSL *ssl, void *arg)
+{
+    sess_shard_struct *shard;
+    sess_entry_struct **bucket, *e;
+    SSL_SESSION *sess = SSL_get0_session(ssl);
+    const unsigned char *id;
+    unsigned int idlen;
+
+    if (sess == NULL)
+        return 0;
+    id = SSL_SESSION_get_id(sess, &idlen);
+    bucket = sess_bucket(id, idlen, &shard);
+    pthread_mutex_lock(&shard->lock);
+    if ((e = sess_find(*bucket, id, idlen)) != NULL)
+        sess_unlink(shard, e);
+    pthread_mutex_unlock(&shard->lock);
+    if (e == NULL)
+        return 0;
+    e->hnext = NULL;
+    sess_free_list(e);
+    return 1;
+}
+#endif
+
+/* drop all expired sessions */
+static void sess_cache_flush(time_t now)
+{
+    int idx;
+    for (idx = 0; idx < PIXEL_SESS_SHARDS; idx++) {
+        sess_entry_struct *gone;
+        pthread_mutex_lock(&sess_shards[idx].lock);
+        gone = sess_expire(&sess_shards[idx], now, -1, PIXEL_SESS_CACHE_KB * 1024 / PIXEL_SESS_SHARDS);
+        pthread_mutex_unlock(&sess_shards[idx].lock);
+        sess_free_list(gone);
+    }
+}
+
+static void sess_cache_cleanup()
+{
+    int idx;
+    for (idx = 0; idx < PIXEL_SESS_SHARDS; idx++) {
+        sess_entry_struct *e, *next;
+        for (e = sess_shards[idx].head; e; e = next) {
+            next = e->next;
+            SSL_SESSION_free(e->sess);
+            free(e);
+        }
+        pthread_mutex_destroy(&sess_shards[idx].lock);
+    }
+    memset(sess_shards, 0, sizeof(sess_shards));
+}
+
+/* make a new current ticket key if due, dropping the oldest */
+static void tls_ticket_keys_rotate()
+{
+    ticket_key_struct key;
+
+    if (tickets.cnt > 0 && process_uptime() - tickets.rotated < PIXEL_TICKET_ROTATE_SEC)
+        return;
+    if (RAND_bytes(key.name, sizeof(key.name)) <= 0 || RAND_bytes(key.aes_key, sizeof(key.aes_key)) <= 0
+        || RAND_bytes(key.hmac_key, sizeof(key.hmac_key)) <= 0) {
+        log_msg(LGG_ERR, "%s: failed to generate ticket key", __FUNCTION__);
+        return;
+    }
+    pthread_rwlock_wrlock(&tickets.lock);
+    if (tickets.cnt == 0 || process_uptime() - tickets.rotated >= PIXEL_TICKET_ROTATE_SEC) {
+        OPENSSL_cleanse(&tickets.keys[PIXEL_TICKET_KEYS - 1], sizeof(ticket_key_struct));
+        memmove(&tickets.keys[1], &tickets.keys[0], (PIXEL_TICKET_KEYS - 1) * sizeof(ticket_key_struct));
+        tickets.keys[0] = key;
+        if (tickets.cnt < PIXEL_TICKET_KEYS)
+            tickets.cnt++;
+        tickets.rotated = process_uptime();
+    }
+    pthread_rwlock_unlock(&tickets.lock);
+    OPENSSL_cleanse(&key, sizeof(key));
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  define TICKET_HMAC_CTX EVP_MAC_CTX
+static int tls_ticket_hmac_init(EVP_MAC_CTX *hctx, unsigned char *hmac_key)
+{
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, hmac_key, PIXEL_TICKET_KEY_SIZE),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, "SHA256", 0),
+        OSSL_PARAM_construct_end()
+    };
+    return EVP_MAC_CTX_set_params(hctx, params);
+}
+#else
+#  define TICKET_HMAC_CTX HMAC_CTX
+static int tls_ticket_hmac_init(HMAC_CTX *hctx, unsigned char *hmac_key)
+{
+    return HMAC_Init_ex(hctx, hmac_key, PIXEL_TICKET_KEY_SIZE, EVP_sha256(), NULL);
+}
+#endif
+
+/* encrypt a new ticket with the current key, or find the key of a ticket
+   presented by the client. Returns 2 to have a ticket of an older key
+   renewed, 0 if the key is gone and a full handshake is due */
+static int tls_ticket_key_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+                             EVP_CIPHER_CTX *ectx, TICKET_HMAC_CTX *hctx, int enc)
+{
+    ticket_key_struct key;
+    int rv = 0, idx;
+
+    if (enc) {
+        tls_ticket_keys_rotate();
+        pthread_rwlock_rdlock(&tickets.lock);
+        key = tickets.keys[0];
+        rv = (tickets.cnt > 0);
+        pthread_rwlock_unlock(&tickets.lock);
+        if (rv && (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0
+                   || EVP_EncryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1
+                   || tls_ticket_hmac_init(hctx, key.hmac_key) != 1))
+            rv = -1;
+        else if (rv)
+            memcpy(key_name, key.name, sizeof(key.name));
+    } else {
+        pthread_rwlock_rdlock(&tickets.lock);
+        for (idx = 0; idx < tickets.cnt && memcmp(key_name, tickets.keys[idx].name, sizeof(key.name)); idx++);
+        if (idx < tickets.cnt) {
+            key = tickets.keys[idx];
+            rv = (idx == 0) ? 1 : 2;
+        }
+        pthread_rwlock_unlock(&tickets.lock);
+        if (rv && (tls_ticket_hmac_init(hctx, key.hmac_key) != 1
+                   || EVP_DecryptInit_ex(ectx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1))
+            rv = -1;
+    }
+    OPENSSL_cleanse(&key, sizeof(key));
+    return rv;
+}
+
+/* stateless session tickets with the shared keys. All contexts get the
+   same session id context, so a session survives the switch from
+   g_sslctx to a child SSL_CTX */
+static void tls_tickets_setup(SSL_CTX *sslctx)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(sslctx, tls_ticket_key_cb);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(sslctx, tls_ticket_key_cb);
+#endif
+    SSL_CTX_set_session_id_context(sslctx, (const unsigned char *)"pixelserv", 9);
+#ifdef TLS1_3_VERSION
+    SSL_CTX_set_num_tickets(sslctx, 1);
+#endif
+}
+
+/* once per connection, after the handshake */
+void tls_count_resumption(SSL *ssl)
+{
+    if (SSL_session_reused(ssl))
+        __sync_fetch_and_add(&tickets.cnt_resumed, 1);
+    else
+        __sync_fetch_and_add(&tickets.cnt_full, 1);
+}
+
+static SSL_CTX* create_child_sslctx(const char* cert_name, const char* full_pem_path, const STACK_OF(X509_INFO) *cachain);
+static unsigned int cert_name_hash(const char *str);
+static int sslctx_tbl_warm(const char *cert_name, const char *cert_file, const STACK_OF(X509_INFO) *cachain, int evict);
+static void cert_cache_drop(const char *cert_name);
 
 void conn_stor_init(int slots) {
     if (slots < 0) {
@@ -107,512 +703,3335 @@ conn_tlstor_struct* conn_stor_acquire() {
     return ret;
 }
 
-void sslctx_tbl_init(int tbl_size)
+static int name_tbl_init(name_tbl *t, unsigned int size)
 {
-    if (tbl_size <= 0)
-        return;
-    sslctx_tbl_end = 0;
-    sslctx_tbl = malloc(tbl_size * sizeof(sslctx_cache_struct));
-    if (!sslctx_tbl) {
-        sslctx_tbl_size = 0;
-        log_msg(LGG_ERR, "Failed to allocate sslctx_tbl of size %d", tbl_size);
-    } else {
-        sslctx_tbl_size = tbl_size;
-        sslctx_tbl_cnt_hit = sslctx_tbl_cnt_miss = sslctx_tbl_cnt_purge = sslctx_tbl_last_flush = 0;
-        memset(sslctx_tbl, 0, tbl_size * sizeof(sslctx_cache_struct));
-    }
+    t->size = size;
+    t->cnt = 0;
+    t->bucket = calloc(size, sizeof(name_node *));
+    return (t->bucket == NULL) ? -1 : 0;
 }
 
-void sslctx_tbl_cleanup()
+static name_node* name_tbl_find(const name_tbl *t, const char *name)
 {
-    int idx;
-    for (idx = 0; idx < sslctx_tbl_end; idx++) {
-        free(SSLCTX_TBL_get(idx, cert_name));
-        SSL_CTX_free(SSLCTX_TBL_get(idx, sslctx));
-    }
-}
+    unsigned int h = cert_name_hash(name);
+    name_node *n;
 
-static int cmp_sslctx_reuse_count(const void *p1, const void *p2)
-{
-    /* reverse order */
-    return ((sslctx_cache_struct *)p2)->reuse_count - ((sslctx_cache_struct *)p1)->reuse_count;
+    for (n = t->bucket[h & (t->size - 1)]; n; n = n->next)
+        if (n->hash == h && !strcmp(n->name, name))
+            break;
+    return n;
 }
 
-static int cmp_sslctx_certname(const void *k, const void *p)
+/* add name or update its value if already present */
+static int name_tbl_add(name_tbl *t, const char *name, long val)
 {
-    return strcmp(((sslctx_cache_struct *)k)->cert_name, ((sslctx_cache_struct *)p)->cert_name);
-}
+    unsigned int h = cert_name_hash(name), idx;
+    name_node *n, *next, **b;
 
-void sslctx_tbl_load(const char* pem_dir, const STACK_OF(X509_INFO) *cachain)
-{
-    FILE *fp;
-    char *fname = NULL, *line;
-    if ((line = malloc(PIXELSERV_MAX_PATH)) == NULL || (fname = malloc(PIXELSERV_MAX_PATH)) == NULL) {
-        log_msg(LGG_ERR, "%s: failed to allocate memory", __FUNCTION__);
-        goto quit_load;
+    if ((n = name_tbl_find(t, name)) != NULL) {
+        n->val = val;
+        return 0;
     }
+    if ((n = malloc(sizeof(name_node) + strlen(name) + 1)) == NULL)
+        return -1;
+    n->hash = h;
+    n->val = val;
+    strcpy(n->name, name);
+    n->next = t->bucket[h & (t->size - 1)];
+    t->bucket[h & (t->size - 1)] = n;
 
-    (void)snprintf(fname, PIXELSERV_MAX_PATH, "%s/prefetch", pem_dir);
-    if((fp = fopen(fname, "r")) == NULL) {
-        log_msg(LGG_WARNING, "%s: %s doesn't exist.", __FUNCTION__, fname);
-        goto quit_load;
+    if (++t->cnt > t->size && (b = calloc(t->size * 2, sizeof(name_node *))) != NULL) {
+        /* double the number of buckets and rehash */
+        for (idx = 0; idx < t->size; idx++)
+            for (n = t->bucket[idx]; n; n = next) {
+                next = n->next;
+                n->next = b[n->hash & (t->size * 2 - 1)];
+                b[n->hash & (t->size * 2 - 1)] = n;
+            }
+        free(t->bucket);
+        t->bucket = b;
+        t->size *= 2;
     }
+    return 0;
+}
 
-    while (getline(&line, &(size_t){ PIXELSERV_MAX_PATH }, fp) != -1) {
-        char *cert_name = strtok(line, " \n\t");
-        (void)snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, cert_name);
+static void name_tbl_del(name_tbl *t, const char *name)
+{
+    unsigned int h = cert_name_hash(name);
+    name_node **p, *n;
 
-        SSL_CTX *sslctx = create_child_sslctx(fname, cachain);
-        if (sslctx) {
-            int ins_idx = sslctx_tbl_end;
-            sslctx_tbl_insert(cert_name, sslctx, ins_idx);
-            log_msg(LGG_NOTICE, "%s: %s", __FUNCTION__, cert_name);
-        }
-        if (sslctx_tbl_end >= sslctx_tbl_size)
+    for (p = &t->bucket[h & (t->size - 1)]; (n = *p) != NULL; p = &n->next)
+        if (n->hash == h && !strcmp(n->name, name)) {
+            *p = n->next;
+            free(n);
+            t->cnt--;
             break;
-    }
-    fclose(fp);
-    sslctx_tbl_cnt_miss = 0; /* reset */
-    qsort(SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_certname);
-quit_load:
-    free(fname);
-    free(line);
+        }
 }
 
-void sslctx_tbl_save(const char* pem_dir)
+static void name_tbl_clear(name_tbl *t)
 {
-    #define RATIO_TO_SAVE 1
-    int idx;
-    char *fname;
-    FILE *fp;
-
-    if ((fname = malloc(PIXELSERV_MAX_PATH)) == NULL) {
-        log_msg(LGG_ERR, "%s: failed to allocate memory", __FUNCTION__);
-        goto quit_save;
-    }
-    (void)snprintf(fname, PIXELSERV_MAX_PATH, "%s/prefetch", pem_dir);
+    unsigned int idx;
+    name_node *n, *next;
 
-    if ((fp = fopen(fname, "w")) == NULL) {
-        log_msg(LGG_ERR, "%s: failed to open %s", __FUNCTION__, fname);
-        goto quit_save;
+    for (idx = 0; t->bucket && idx < t->size; idx++) {
+        for (n = t->bucket[idx]; n; n = next) {
+            next = n->next;
+            free(n);
+        }
+        t->bucket[idx] = NULL;
     }
-    qsort(SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_reuse_count);
-    if (sslctx_tbl_end > (sslctx_tbl_size * RATIO_TO_SAVE))
-        sslctx_tbl_end = sslctx_tbl_size * RATIO_TO_SAVE;
+    t->cnt = 0;
+}
 
-    for (idx=0; idx < sslctx_tbl_end; idx++)
-        fprintf(fp, "%s\t%d\n", SSLCTX_TBL_get(idx, cert_name), SSLCTX_TBL_get(idx, reuse_count));
-    fclose(fp);
-quit_save:
-    free(fname);
+static void name_tbl_free(name_tbl *t)
+{
+    name_tbl_clear(t);
+    free(t->bucket);
+    t->bucket = NULL;
 }
 
-void sslctx_tbl_lock(int idx)
+static void cert_idx_add(const char *name)
 {
-    if (idx < 0 || idx >= sslctx_tbl_size) {
-        log_msg(LOG_DEBUG, "%s: invalid idx %d", __FUNCTION__, idx);
-        return;
-    }
-    pthread_mutex_lock(&SSLCTX_TBL_get(idx, lock));
+    pthread_mutex_lock(&cert_idx.lock);
+    if (cert_idx.files.bucket != NULL)
+        name_tbl_add(&cert_idx.files, name, 0);
+    pthread_mutex_unlock(&cert_idx.lock);
 }
 
-void sslctx_tbl_unlock(int idx)
+static void cert_idx_del(const char *name)
 {
-    if (idx < 0 || idx >= sslctx_tbl_size) {
-        log_msg(LOG_DEBUG, "%s: invalid idx %d", __FUNCTION__, idx);
-        return;
-    }
-    pthread_mutex_unlock(&SSLCTX_TBL_get(idx, lock));
+    pthread_mutex_lock(&cert_idx.lock);
+    if (cert_idx.files.bucket != NULL)
+        name_tbl_del(&cert_idx.files, name);
+    pthread_mutex_unlock(&cert_idx.lock);
 }
 
-static int sslctx_tbl_check_and_flush(void)
+/* look up cert_name in the index. Fall back to stat() full_pem_path
+   if no index is available */
+static int cert_idx_exists(const char *cert_name, const char *full_pem_path)
 {
-    int pixel_now = process_uptime(), rv = -1;
-#ifdef DEBUG
-    printf("%s: now %d last_flush %d", __FUNCTION__, pixel_now, sslctx_tbl_last_flush);
-#endif
+    int rv;
+    struct stat st;
 
-    /* flush at most every half of session timeout */
-    int do_flush = pixel_now - sslctx_tbl_last_flush - PIXEL_SSL_SESS_TIMEOUT / 2;
-    if (do_flush < 0) {
-        rv = -1;
-    } else {
-        SSL_CTX_flush_sessions(g_sslctx, time(NULL));
-        sslctx_tbl_last_flush = pixel_now;
-        rv = 1;
-    }
+    pthread_mutex_lock(&cert_idx.lock);
+    if (cert_idx.files.bucket == NULL)
+        rv = (stat(full_pem_path, &st) == 0);
+    else
+        rv = (name_tbl_find(&cert_idx.files, cert_name) != NULL);
+    pthread_mutex_unlock(&cert_idx.lock);
     return rv;
 }
 
-static int sslctx_tbl_lookup(char* cert_name, int* found_idx, int* ins_idx)
+static int cert_idx_scan()
 {
-    *found_idx = -1; *ins_idx = -1;
-    if (!cert_name || !found_idx || !ins_idx) {
-        log_msg(LOG_ERR, "Invalid params. cert_name: %s. found_idx: %d, ins_idx: %d",
-            cert_name, found_idx, ins_idx);
+    DIR *dir;
+    struct dirent *de;
+
+    if ((dir = opendir(cert_idx.pem_dir)) == NULL) {
+        log_msg(LGG_ERR, "%s: failed to open %s: %m", __FUNCTION__, cert_idx.pem_dir);
         return -1;
     }
+    pthread_mutex_lock(&cert_idx.lock);
+    name_tbl_clear(&cert_idx.files);
+    while ((de = readdir(dir)) != NULL)
+        if (de->d_name[0] != '.')
+            name_tbl_add(&cert_idx.files, de->d_name, 0);
+    pthread_mutex_unlock(&cert_idx.lock);
+    closedir(dir);
+    log_msg(LGG_NOTICE, "%s: %d files in %s", __FUNCTION__, cert_idx.files.cnt, cert_idx.pem_dir);
+    return 0;
+}
 
-    sslctx_cache_struct key, *found;
-    key.cert_name = cert_name;
-    found = bsearch(&key, SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_certname);
+void cert_idx_init(const char *pem_dir)
+{
+    cert_idx.pem_dir = pem_dir;
+    if (name_tbl_init(&cert_idx.files, 1024) < 0) {
+        log_msg(LGG_ERR, "%s: failed to allocate cert index", __FUNCTION__);
+        return;
+    }
+#ifdef linux
+    cert_idx.ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cert_idx.ifd < 0 || inotify_add_watch(cert_idx.ifd, pem_dir,
+            IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM) < 0) {
+        log_msg(LGG_WARNING, "%s: inotify not available for %s: %m", __FUNCTION__, pem_dir);
+        if (cert_idx.ifd >= 0)
+            close(cert_idx.ifd);
+        cert_idx.ifd = -1;
+    }
+#endif
+    if (cert_idx_scan() < 0) /* no index. fall back to stat() */
+        name_tbl_free(&cert_idx.files);
+}
 
-    if (found != NULL) {
-        sslctx_tbl_cnt_hit++;
-        found->reuse_count++;
-        found->last_use = process_uptime();
-        *found_idx = (found - SSLCTX_TBL_ptr(0));
-    } else if (sslctx_tbl_end < sslctx_tbl_size) {
-        *ins_idx = sslctx_tbl_end;
-    } else {
-        int idx, purge_idx = 0; // decimate the first entry if no suitable candiate
-        int _last_use = process_uptime();
+void cert_idx_cleanup()
+{
+    name_tbl_free(&cert_idx.files);
+    if (cert_idx.ifd >= 0)
+        close(cert_idx.ifd);
+}
 
-        for (idx = 0; idx < sslctx_tbl_end; idx++) {
-            if (SSLCTX_TBL_get(idx, last_use) < _last_use) {
-                _last_use = SSLCTX_TBL_get(idx, last_use);
-                purge_idx = idx;
-            }
+#ifdef linux
+static void cert_idx_read_events()
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    ssize_t len;
+    char *p;
+
+    while ((len = read(cert_idx.ifd, buf, sizeof buf)) > 0)
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                log_msg(LGG_NOTICE, "%s: event queue overflow. rescan", __FUNCTION__);
+                cert_idx_scan();
+            } else if (ev->len == 0 || ev->name[0] == '.')
+                continue;
+            else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+                cert_idx_add(ev->name);
+            else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+                cert_idx_del(ev->name);
         }
-        *ins_idx = purge_idx;
-    }
-    return 0;
 }
+#endif
 
-static int sslctx_tbl_insert(const char *cert_name, SSL_CTX *sslctx, int ins_idx)
+/* map the store and index records from offset off onwards. Later records
+   of a name supersede earlier ones. A torn record at the end, e.g. from
+   power loss during append, is truncated. The mapping reaches
+   PIXEL_CERT_STORE_HEADROOM past the end: appended records show up in it
+   and are indexed without a remap until the file outgrows it */
+static int cert_store_map(size_t off)
 {
-    if (cert_name == NULL || sslctx == NULL || ins_idx >= sslctx_tbl_size || ins_idx < 0) {
-        log_msg(LOG_ERR, "Invalid params. cert_name: %s. sslctx: %d, ins_idx: %d",
-            cert_name, sslctx, ins_idx);
+    struct stat st;
+
+    if (fstat(cert_store.fd, &st) < 0)
         return -1;
+    if (off > st.st_size) {
+        /* shrunk behind our back. Index from scratch */
+        name_tbl_clear(&cert_store.idx);
+        off = 0;
+    }
+    cert_store.size = st.st_size;
+    cert_store.end = off;
+    if (st.st_size == 0)
+        return 0;
+    if (st.st_size > cert_store.map_len) {
+        if (cert_store.map)
+            munmap((void *)cert_store.map, cert_store.map_len);
+        cert_store.map_len = 0;
+        cert_store.map = mmap(NULL, st.st_size + PIXEL_CERT_STORE_HEADROOM, PROT_READ, MAP_SHARED, cert_store.fd, 0);
+        if (cert_store.map == MAP_FAILED) {
+            cert_store.map = NULL;
+            return -1;
+        }
+        cert_store.map_len = st.st_size + PIXEL_CERT_STORE_HEADROOM;
     }
-    sslctx_tbl_cnt_miss++;
 
-    /* add new cache entry */
-    unsigned int pixel_now = process_uptime();
-    int len = strlen(cert_name);
-    char *str = SSLCTX_TBL_get(ins_idx, cert_name);
-    if ((len + 1) > SSLCTX_TBL_get(ins_idx, alloc_len)) {
-        str = realloc(str, len + 1);
-        SSLCTX_TBL_set(ins_idx, alloc_len, len + 1);
+    while (off + sizeof(cert_store_rec) <= st.st_size) {
+        const cert_store_rec *r = (const cert_store_rec *)(cert_store.map + off);
+        if (r->magic != PIXEL_CERT_STORE_MAGIC || r->rec_len > st.st_size - off
+            || sizeof(cert_store_rec) + r->name_len + r->cert_len + r->key_len > r->rec_len
+            || r->name_len == 0 || ((const char *)(r + 1))[r->name_len - 1] != '\0')
+            break;
+        name_tbl_add(&cert_store.idx, (const char *)(r + 1), off);
+        off += r->rec_len;
     }
-    strncpy(str, cert_name, len + 1);
-    SSLCTX_TBL_set(ins_idx, cert_name, str);
-    SSLCTX_TBL_set(ins_idx, last_use, pixel_now);
-    SSLCTX_TBL_set(ins_idx, reuse_count, 0);
-    if (ins_idx == sslctx_tbl_end && sslctx_tbl_end < sslctx_tbl_size) {
-        sslctx_tbl_end++;
-    } else {
-#ifdef DEBUG
-        printf("%s: SSL_CTX_free %p sslctx_tbl_end %d\n", __FUNCTION__, SSLCTX_TBL_get(ins_idx, sslctx), sslctx_tbl_end);
-#endif
-        SSL_CTX_free(SSLCTX_TBL_get(ins_idx, sslctx));
-        sslctx_tbl_cnt_purge++;
+    cert_store.end = off;
+    if (off < st.st_size) {
+        log_msg(LGG_WARNING, "%s: truncate invalid data at offset %u", __FUNCTION__, (unsigned int)off);
+        if (ftruncate(cert_store.fd, off) < 0)
+            log_msg(LGG_ERR, "%s: failed to truncate: %m", __FUNCTION__);
+        else
+            cert_store.size = off;
     }
-    SSLCTX_TBL_set(ins_idx, sslctx, sslctx);
     return 0;
 }
 
-static int sslctx_tbl_cache(const char *cert_name, SSL_CTX *sslctx, int ins_idx)
-{   int ret = -1;
-    if (sslctx_tbl_insert(cert_name, sslctx, ins_idx) == 0) {
-        qsort(SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_certname);
-        ret = 0;
+int cert_store_open(const char *pem_dir)
+{
+    char fname[PIXELSERV_MAX_PATH];
+
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, PIXEL_CERT_STORE);
+    if (name_tbl_init(&cert_store.idx, 1024) < 0
+        || (cert_store.fd = open(fname, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600)) < 0
+        || cert_store_map(0) < 0)
+    {
+        log_msg(LGG_ERR, "%s: failed to open %s: %m", __FUNCTION__, fname);
+        cert_store_close();
+        return -1;
     }
-    return ret;
+    log_msg(LGG_NOTICE, "%s: %d certs in %s", __FUNCTION__, cert_store.idx.cnt, fname);
+    return 0;
 }
 
-#ifdef DEBUG
-static void sslctx_tbl_dump(int idx, const char * func)
+int cert_store_chown(uid_t uid, gid_t gid)
 {
-    printf("%s: idx %d now %d\n", func, idx, process_uptime());
-    printf("** cert_name %s\n", sslctx_tbl[idx].cert_name);
-    printf("** alloc_len %d\n", sslctx_tbl[idx].alloc_len);
-    printf("** last_use %d\n", sslctx_tbl[idx].last_use);
-    printf("** reuse_count %d\n", sslctx_tbl[idx].reuse_count);
-    printf("** sslctx %p\n", sslctx_tbl[idx].sslctx);
+    return (cert_store.fd < 0) ? 0 : fchown(cert_store.fd, uid, gid);
 }
-#endif
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-static void ssl_lock_cb(int mode, int type, const char *file, int line)
+void cert_store_close()
 {
-    if (mode & CRYPTO_LOCK)
-        pthread_mutex_lock(&(locks[type]));
+    if (cert_store.map)
+        munmap((void *)cert_store.map, cert_store.map_len);
+    cert_store.map = NULL;
+    cert_store.map_len = 0;
+    if (cert_store.fd >= 0)
+        close(cert_store.fd);
+    cert_store.fd = -1;
+    name_tbl_free(&cert_store.idx);
+}
+
+static int cert_store_has(const char *cert_name)
+{
+    int rv = 0;
+    if (cert_store.fd < 0)
+        return 0;
+    pthread_rwlock_rdlock(&cert_store.lock);
+    rv = (name_tbl_find(&cert_store.idx, cert_name) != NULL);
+    pthread_rwlock_unlock(&cert_store.lock);
+    return rv;
+}
+
+/* the shared leaf key, with a reference for the caller, if it belongs to
+   x509. NULL otherwise */
+static EVP_PKEY* shared_key_for(X509 *x509)
+{
+    if (shared_key == NULL || x509 == NULL || X509_check_private_key(x509, shared_key) != 1) {
+        ERR_clear_error();
+        return NULL;
+    }
+    EVP_PKEY_up_ref(shared_key);
+    return shared_key;
+}
+
+/* DER size of key in cert store and DER tier records. The shared key is
+   not stored */
+static int key_der_len(EVP_PKEY *key)
+{
+    return (key == shared_key) ? 0 : i2d_PrivateKey(key, NULL);
+}
+
+static EVP_PKEY* key_from_der(X509 *x509, const unsigned char **p, int len)
+{
+    return (len == 0) ? shared_key_for(x509) : d2i_AutoPrivateKey(NULL, p, len);
+}
+
+/* decode cert and key of cert_name straight from the mapping */
+static int cert_store_get(const char *cert_name, X509 **x509, EVP_PKEY **key)
+{
+    name_node *n;
+    int rv = -1;
+
+    *x509 = NULL; *key = NULL;
+    if (cert_store.fd < 0)
+        return -1;
+    pthread_rwlock_rdlock(&cert_store.lock);
+    if ((n = name_tbl_find(&cert_store.idx, cert_name)) != NULL) {
+        const cert_store_rec *r = (const cert_store_rec *)(cert_store.map + n->val);
+        const unsigned char *p = (const unsigned char *)(r + 1) + r->name_len;
+        if ((*x509 = d2i_X509(NULL, &p, r->cert_len)) != NULL
+            && (*key = key_from_der(*x509, &p, r->key_len)) != NULL)
+            rv = 0;
+    }
+    pthread_rwlock_unlock(&cert_store.lock);
+    if (rv < 0) {
+        X509_free(*x509);
+        *x509 = NULL;
+    }
+    return rv;
+}
+
+static int cert_store_append(const char *cert_name, X509 *x509, EVP_PKEY *key)
+{
+    cert_store_rec *r;
+    unsigned char *p;
+    int name_len = strlen(cert_name) + 1;
+    int cert_len = i2d_X509(x509, NULL);
+    int key_len = key_der_len(key);
+    int rec_len = (sizeof(cert_store_rec) + name_len + cert_len + key_len + 7) & ~7;
+    int rv = -1;
+
+    if (cert_store.fd < 0 || cert_len <= 0 || key_len < 0
+        || cert_len > 0xffff || key_len > 0xffff || name_len > PIXELSERV_MAX_SERVER_NAME + 1
+        || (r = calloc(1, rec_len)) == NULL)
+        return -1;
+    r->magic = PIXEL_CERT_STORE_MAGIC;
+    r->rec_len = rec_len;
+    r->name_len = name_len;
+    r->cert_len = cert_len;
+    r->key_len = key_len;
+    p = (unsigned char *)(r + 1);
+    memcpy(p, cert_name, name_len);
+    p += name_len;
+    i2d_X509(x509, &p);
+    if (key_len > 0)
+        i2d_PrivateKey(key, &p);
+
+    pthread_rwlock_wrlock(&cert_store.lock);
+    /* a torn tail not truncated yet would hide the new record */
+    if (cert_store.size > cert_store.end && ftruncate(cert_store.fd, cert_store.end) < 0)
+        log_msg(LGG_ERR, "%s: failed to truncate: %m", __FUNCTION__);
+    else if (write(cert_store.fd, r, rec_len) == rec_len)
+        rv = cert_store_map(cert_store.end);
     else
-        pthread_mutex_unlock(&(locks[type]));
+        log_msg(LGG_ERR, "%s: failed to write %s: %m", __FUNCTION__, cert_name);
+    pthread_rwlock_unlock(&cert_store.lock);
+    free(r);
+    return rv;
 }
-#endif
 
-void ssl_thread_id(CRYPTO_THREADID *id)
+/* files in CERT_PATH other than certs */
+static int is_cert_file(const char *name)
 {
-    CRYPTO_THREADID_set_numeric(id, (unsigned long) pthread_self());
+    return !(name[0] == '.' || !strncmp(name, "ca.", 3)
+             || !strcmp(name, "prefetch") || !strcmp(name, PIXEL_CERT_STORE)
+             || !strcmp(name, PIXEL_KEY_POOL_FILE) || !strcmp(name, PIXEL_SHARED_KEY_FILE)
+             || !strcmp(name, PIXEL_BUNDLE_FILE) || !strcmp(name, PIXEL_USAGE_FILE)
+             || !strcmp(name, PIXEL_ARCHIVE_DIR));
 }
 
-void ssl_init_locks()
+/* import PEM files in pem_dir into the store */
+int cert_store_import(const char *pem_dir)
 {
-#ifdef DEBUG
-    printf("%s: CRYPTO_num_locks = %d\n", __FUNCTION__, CRYPTO_num_locks());
-#endif
-    int i;
-    locks = (pthread_mutex_t *)OPENSSL_malloc(CRYPTO_num_locks()*sizeof(pthread_mutex_t));
-    for (i = 0; i < CRYPTO_num_locks(); i++)
-        pthread_mutex_init(&(locks[i]), NULL);
+    DIR *dir;
+    struct dirent *de;
+    char fname[PIXELSERV_MAX_PATH];
+    int cnt = 0;
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-    CRYPTO_THREADID_set_callback((void (*)(CRYPTO_THREADID *)) ssl_thread_id);
-    CRYPTO_set_locking_callback((void (*)(int, int, const char *, int)) ssl_lock_cb);
-#endif
+    if ((dir = opendir(pem_dir)) == NULL) {
+        printf("failed to open %s\n", pem_dir);
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        FILE *fp;
+        X509 *x509 = NULL;
+        EVP_PKEY *key = NULL;
+
+        if (!is_cert_file(de->d_name))
+            continue;
+        snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, de->d_name);
+        if ((fp = fopen(fname, "r")) == NULL)
+            continue;
+        if (PEM_read_X509(fp, &x509, NULL, NULL)
+            && (PEM_read_PrivateKey(fp, &key, NULL, NULL) || (key = shared_key_for(x509)) != NULL)
+            && cert_store_append(de->d_name, x509, key) == 0)
+            cnt++;
+        else
+            printf("skipped %s\n", de->d_name);
+        fclose(fp);
+        X509_free(x509);
+        EVP_PKEY_free(key);
+    }
+    closedir(dir);
+    printf("imported %d certs into %s/%s\n", cnt, pem_dir, PIXEL_CERT_STORE);
+    return cnt;
 }
 
-void ssl_free_locks()
+/* export every cert in the store to a PEM file per cert in pem_dir */
+int cert_store_export(const char *pem_dir)
 {
-    int i;
-    CRYPTO_set_locking_callback(NULL);
-    for (i = 0; i < CRYPTO_num_locks(); i++)
-        pthread_mutex_destroy(&(locks[i]));
+    unsigned int idx;
+    name_node *n;
+    char fname[PIXELSERV_MAX_PATH];
+    int cnt = 0;
 
-    OPENSSL_free(locks);
+    for (idx = 0; cert_store.idx.bucket && idx < cert_store.idx.size; idx++)
+        for (n = cert_store.idx.bucket[idx]; n; n = n->next) {
+            FILE *fp;
+            X509 *x509;
+            EVP_PKEY *key;
+
+            if (cert_store_get(n->name, &x509, &key) < 0)
+                continue;
+            snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, n->name);
+            if ((fp = fopen(fname, "wb")) != NULL) {
+                PEM_write_X509(fp, x509);
+                PEM_write_PrivateKey(fp, key, NULL, NULL, 0, NULL, NULL);
+                fclose(fp);
+                cnt++;
+            }
+            X509_free(x509);
+            EVP_PKEY_free(key);
+        }
+    printf("exported %d certs from %s/%s\n", cnt, pem_dir, PIXEL_CERT_STORE);
+    return cnt;
 }
 
-static void generate_cert(char* pem_fn, const char *pem_dir, X509_NAME *issuer, EVP_PKEY *privkey)
+/* read cert and key from a PEM file. Files of certs with the shared key
+   hold the cert only */
+static int cert_read_pem(const char *fname, X509 **x509, EVP_PKEY **key)
+{
+    FILE *fp;
+    int fd;
+
+    *x509 = NULL; *key = NULL;
+    if ((fd = open(fname, O_RDONLY | O_NOFOLLOW)) < 0)
+        return -1;
+    if ((fp = fdopen(fd, "r")) == NULL) {
+        close(fd);
+        return -1;
+    }
+    if (PEM_read_X509(fp, x509, NULL, NULL) == NULL
+        || (PEM_read_PrivateKey(fp, key, NULL, NULL) == NULL && (*key = shared_key_for(*x509)) == NULL)) {
+        X509_free(*x509);
+        *x509 = NULL;
+    }
+    fclose(fp);
+    return (*x509 == NULL) ? -1 : 0;
+}
+
+static int cert_stage_has(const char *cert_name)
+{
+    int rv;
+    if (cert_stage.delay <= 0)
+        return 0;
+    pthread_mutex_lock(&cert_stage.lock);
+    rv = (name_tbl_find(&cert_stage.names, cert_name) != NULL);
+    pthread_mutex_unlock(&cert_stage.lock);
+    return rv;
+}
+
+/* cert and key of a cert not yet flushed to CERT_PATH */
+static int cert_stage_get(const char *cert_name, X509 **x509, EVP_PKEY **key)
 {
     char fname[PIXELSERV_MAX_PATH];
-    EVP_PKEY *key = NULL;
+    int rv = -1;
+
+    *x509 = NULL; *key = NULL;
+    if (cert_stage.delay <= 0)
+        return -1;
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", cert_stage.dir, cert_name);
+    pthread_mutex_lock(&cert_stage.lock);
+    if (name_tbl_find(&cert_stage.names, cert_name) != NULL)
+        rv = cert_read_pem(fname, x509, key);
+    pthread_mutex_unlock(&cert_stage.lock);
+    return rv;
+}
+
+/* staged certs are written to CERT_PATH before being unstaged, so looking
+   in the staging area first never misses one being flushed */
+static int cert_exists(const char *cert_name, const char *full_pem_path)
+{
+    return cert_stage_has(cert_name) || cert_store_has(cert_name) || cert_idx_exists(cert_name, full_pem_path);
+}
+
+/* 1 if cert_name is on disk without a key of its own and the shared key
+   is not its key: written with -S and leaf.key replaced since, e.g. by a
+   new -K, or -S turned off since. Such a cert is dropped from the store
+   and CERT_PATH so that it gets generated anew */
+static int cert_drop_keyless(const char *cert_name, const char *full_pem_path)
+{
+    const unsigned char *p;
+    name_node *n;
     X509 *x509 = NULL;
-    X509_EXTENSION *ext = NULL;
-    X509V3_CTX ext_ctx;
-#define SAN_STR_SIZE PIXELSERV_MAX_SERVER_NAME + 4 /* max("IP:", "DNS:") = 4 */
-    char san_str[SAN_STR_SIZE];
-    char *tld = NULL, *tld_tmp = NULL;
-    int dot_count = 0;
-    EVP_MD_CTX *p_ctx = NULL;
+    EVP_PKEY *key = NULL;
+    FILE *fp;
+    int keyless = 0;
 
-    p_ctx = EVP_MD_CTX_create();
-    if(EVP_DigestSignInit(p_ctx, NULL, EVP_sha256(), NULL, privkey) != 1)
-        log_msg(LGG_ERR, "%s: failed to init sign context", __FUNCTION__);
+    if (cert_store.fd >= 0) {
+        pthread_rwlock_wrlock(&cert_store.lock);
+        if ((n = name_tbl_find(&cert_store.idx, cert_name)) != NULL) {
+            const cert_store_rec *r = (const cert_store_rec *)(cert_store.map + n->val);
+            p = (const unsigned char *)(r + 1) + r->name_len;
+            if (r->key_len == 0 && (x509 = d2i_X509(NULL, &p, r->cert_len)) != NULL
+                && (key = shared_key_for(x509)) == NULL) {
+                name_tbl_del(&cert_store.idx, cert_name);
+                keyless = 1;
+            }
+        }
+        pthread_rwlock_unlock(&cert_store.lock);
+    }
+    if (x509 == NULL && (fp = fopen(full_pem_path, "r")) != NULL) {
+        if (PEM_read_X509(fp, &x509, NULL, NULL) != NULL && PEM_read_PrivateKey(fp, NULL, NULL, NULL) == NULL
+            && (key = shared_key_for(x509)) == NULL)
+            keyless = 1;
+        fclose(fp);
+        if (keyless && unlink(full_pem_path) < 0)
+            log_msg(LGG_ERR, "%s: failed to remove %s: %m", __FUNCTION__, full_pem_path);
+        else if (keyless)
+            cert_idx_del(cert_name);
+    }
+    ERR_clear_error();
+    X509_free(x509);
+    EVP_PKEY_free(key);
+    if (keyless)
+        log_msg(LGG_WARNING, "%s: key of %s is gone. regenerate", __FUNCTION__, cert_name);
+    return keyless;
+}
 
-    if(pem_fn[0] == '_') pem_fn[0] = '*';
+/* record a use of cert_name, or just start tracking it if hit is 0.
+   Written to disk in batches by usage_save() */
+static void usage_touch(const char *cert_name, int hit)
+{
+    name_node *n;
+    usage_struct *u;
 
-    // -- generate cert
-    RSA *rsa = RSA_new();
-    BIGNUM *e = BN_new();
-    BN_set_word(e, RSA_F4); 
-    if (RSA_generate_key_ex(rsa, 1024, e, NULL) < 0)
-        goto free_all;
-#ifdef DEBUG
-    printf("%s: rsa key generated for [%s]\n", __FUNCTION__, pem_fn);
-#endif
-    key = EVP_PKEY_new();
-    EVP_PKEY_assign_RSA(key, rsa); // rsa will be freed when key is freed
-#ifdef DEBUG
-    printf("%s: rsa key assigned\n", __FUNCTION__);
-#endif
-    if((x509 = X509_new()) == NULL)
-        goto free_all;
-    ASN1_INTEGER_set(X509_get_serialNumber(x509),rand());
-    X509_set_version(x509,2); // X509 v3
-    X509_gmtime_adj(X509_get_notBefore(x509), 0);
-    X509_gmtime_adj(X509_get_notAfter(x509), 315360000L); // cert valid for 10yrs
-    X509_set_issuer_name(x509, issuer);
-    X509_NAME *name = X509_get_subject_name(x509);
-    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char *)pem_fn, -1, -1, 0);
-    X509V3_set_ctx_nodb(&ext_ctx);
+    pthread_mutex_lock(&usage.lock);
+    if (usage.names.bucket == NULL)
+        goto quit_touch;
+    if ((n = name_tbl_find(&usage.names, cert_name)) != NULL)
+        u = (usage_struct *)n->val;
+    else if ((u = calloc(1, sizeof(usage_struct))) == NULL
+             || name_tbl_add(&usage.names, cert_name, (long)u) < 0) {
+        free(u);
+        goto quit_touch;
+    }
+    if (hit || u->last == 0)
+        u->last = time(NULL);
+    u->hits += hit;
+    usage.dirty = 1;
+quit_touch:
+    pthread_mutex_unlock(&usage.lock);
+}
 
-    tld_tmp = strchr(pem_fn, '.');
-    while(tld_tmp != NULL) {
-        dot_count++;
-        tld = tld_tmp + 1;
-        tld_tmp = strchr(tld, '.');
+static void usage_del(const char *cert_name)
+{
+    name_node *n;
+
+    pthread_mutex_lock(&usage.lock);
+    if (usage.names.bucket && (n = name_tbl_find(&usage.names, cert_name)) != NULL) {
+        free((usage_struct *)n->val);
+        name_tbl_del(&usage.names, cert_name);
+        usage.dirty = 1;
     }
-    tld_tmp = (dot_count == 3 && (atoi(tld) > 0 || (atoi(tld) == 0 && strlen(tld) == 1))) ? "IP" : "DNS";
-    snprintf(san_str, SAN_STR_SIZE, "%s:%s", tld_tmp, pem_fn);
-    if ((ext = X509V3_EXT_conf_nid(NULL, &ext_ctx, NID_subject_alt_name, san_str)) == NULL)
-        goto free_all;
-    X509_add_ext(x509, ext, -1);
-    X509_set_pubkey(x509, key);
-    X509_sign_ctx(x509, p_ctx);
-#ifdef DEBUG
-    printf("%s: x509 cert created\n", __FUNCTION__);
-#endif
+    pthread_mutex_unlock(&usage.lock);
+}
 
-    // -- save cert
-    if(pem_fn[0] == '*')
-        pem_fn[0] = '_';
-    snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, pem_fn);
-    FILE *fp = fopen(fname, "wb");
-    if(fp == NULL) {
-        log_msg(LGG_ERR, "%s: failed to open file for write: %s", __FUNCTION__, fname);
-        goto free_all;
+/* write PIXEL_USAGE_FILE if changed. The table is copied under usage.lock
+   and written out after, not to hold up handshakes on slow storage */
+void usage_save(const char *pem_dir)
+{
+    char fname[PIXELSERV_MAX_PATH], tmp_fname[PIXELSERV_MAX_PATH];
+    unsigned int idx;
+    name_node *n;
+    usage_struct *snap = NULL;
+    char **names = NULL;
+    int cnt = 0, i;
+    FILE *fp;
+
+    pthread_mutex_lock(&usage.save_lock);
+    pthread_mutex_lock(&usage.lock);
+    if (usage.names.bucket == NULL || !usage.dirty) {
+        pthread_mutex_unlock(&usage.lock);
+        goto quit_save;
+    }
+    if ((snap = malloc(usage.names.cnt * sizeof(usage_struct) + 1)) != NULL
+        && (names = malloc(usage.names.cnt * sizeof(char *) + 1)) != NULL)
+        for (idx = 0; idx < usage.names.size; idx++)
+            for (n = usage.names.bucket[idx]; n; n = n->next)
+                if ((names[cnt] = strdup(n->name)) != NULL)
+                    snap[cnt++] = *(usage_struct *)n->val;
+    if (names)
+        usage.dirty = 0;
+    pthread_mutex_unlock(&usage.lock);
+    if (names == NULL) {
+        log_msg(LGG_ERR, "%s: failed to allocate memory", __FUNCTION__);
+        goto quit_save;
+    }
+
+    snprintf(tmp_fname, PIXELSERV_MAX_PATH, "%s/.%s.tmp", pem_dir, PIXEL_USAGE_FILE);
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, PIXEL_USAGE_FILE);
+    if ((fp = fopen(tmp_fname, "w")) == NULL) {
+        log_msg(LGG_ERR, "%s: failed to open %s: %m", __FUNCTION__, tmp_fname);
+        goto quit_retry;
+    }
+    for (i = 0; i < cnt; i++)
+        fprintf(fp, "%s\t%ld\t%u\n", names[i], (long)snap[i].last, snap[i].hits);
+    if (fclose(fp) == 0 && rename(tmp_fname, fname) == 0)
+        goto quit_save;
+    log_msg(LGG_ERR, "%s: failed to write %s: %m", __FUNCTION__, fname);
+    unlink(tmp_fname);
+quit_retry:
+    /* written again on the next checkpoint */
+    pthread_mutex_lock(&usage.lock);
+    usage.dirty = 1;
+    pthread_mutex_unlock(&usage.lock);
+quit_save:
+    for (i = 0; i < cnt; i++)
+        free(names[i]);
+    free(names);
+    free(snap);
+    pthread_mutex_unlock(&usage.save_lock);
+}
+
+/* load PIXEL_USAGE_FILE and start tracking certs not in it yet */
+void usage_init(const char *pem_dir, int gc_days, int gc_archive)
+{
+    char fname[PIXELSERV_MAX_PATH], name[PIXELSERV_MAX_SERVER_NAME + 2];
+    unsigned int idx, hits;
+    long last;
+    name_node *n;
+    usage_struct *u;
+    FILE *fp;
+
+    if (name_tbl_init(&usage.names, 1024) < 0) {
+        log_msg(LGG_ERR, "%s: failed to allocate usage table", __FUNCTION__);
+        return;
+    }
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, PIXEL_USAGE_FILE);
+    if ((fp = fopen(fname, "r")) != NULL) {
+        while (fscanf(fp, "%256s %ld %u", name, &last, &hits) == 3)
+            if ((u = malloc(sizeof(usage_struct))) != NULL) {
+                u->last = last;
+                u->hits = hits;
+                if (name_tbl_find(&usage.names, name) != NULL
+                    || name_tbl_add(&usage.names, name, (long)u) < 0)
+                    free(u);
+            }
+        fclose(fp);
+    }
+    pthread_mutex_lock(&cert_idx.lock);
+    for (idx = 0; cert_idx.files.bucket && idx < cert_idx.files.size; idx++)
+        for (n = cert_idx.files.bucket[idx]; n; n = n->next)
+            if (is_cert_file(n->name) && name_tbl_find(&usage.names, n->name) == NULL)
+                usage_touch(n->name, 0);
+    pthread_mutex_unlock(&cert_idx.lock);
+    for (idx = 0; cert_store.idx.bucket && idx < cert_store.idx.size; idx++)
+        for (n = cert_store.idx.bucket[idx]; n; n = n->next)
+            if (name_tbl_find(&usage.names, n->name) == NULL)
+                usage_touch(n->name, 0);
+    log_msg(LGG_NOTICE, "%s: tracking %d certs", __FUNCTION__, usage.names.cnt);
+
+    if (gc_days > 0 && cert_store.fd >= 0)
+        log_msg(LGG_WARNING, "%s: no GC of the cert store", __FUNCTION__);
+    else
+        usage.gc_days = gc_days;
+    usage.gc_archive = gc_archive;
+}
+
+void usage_cleanup()
+{
+    unsigned int idx;
+    name_node *n;
+
+    for (idx = 0; usage.names.bucket && idx < usage.names.size; idx++)
+        for (n = usage.names.bucket[idx]; n; n = n->next)
+            free((usage_struct *)n->val);
+    name_tbl_free(&usage.names);
+}
+
+/* drop names of removed certs from the prefetch list, keeping the order */
+static void prefetch_prune(const char *pem_dir)
+{
+    char fname[PIXELSERV_MAX_PATH], tmp_fname[PIXELSERV_MAX_PATH], cert_file[PIXELSERV_MAX_PATH];
+    char line[PIXELSERV_MAX_SERVER_NAME * 2], name[PIXELSERV_MAX_SERVER_NAME + 2];
+    FILE *fp, *tmp_fp;
+
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/prefetch", pem_dir);
+    snprintf(tmp_fname, PIXELSERV_MAX_PATH, "%s/.prefetch.tmp", pem_dir);
+    pthread_mutex_lock(&checkpoint.file_lock);
+    if ((fp = fopen(fname, "r")) == NULL)
+        goto quit_prune;
+    if ((tmp_fp = fopen(tmp_fname, "w")) == NULL) {
+        fclose(fp);
+        goto quit_prune;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        snprintf(cert_file, PIXELSERV_MAX_PATH, "%s/", pem_dir);
+        if (sscanf(line, "%256s", name) == 1
+            && strlen(cert_file) + strlen(name) < PIXELSERV_MAX_PATH
+            && cert_exists(name, strcat(cert_file, name)))
+            fputs(line, tmp_fp);
     }
-    PEM_write_X509(fp, x509);
-    PEM_write_PrivateKey(fp, key, NULL, NULL, 0, NULL, NULL);
     fclose(fp);
-    log_msg(LGG_NOTICE, "cert generated to disk: %s", pem_fn);
+    if (fclose(tmp_fp) != 0 || rename(tmp_fname, fname) != 0) {
+        log_msg(LGG_ERR, "%s: failed to write %s: %m", __FUNCTION__, fname);
+        unlink(tmp_fname);
+    }
+quit_prune:
+    pthread_mutex_unlock(&checkpoint.file_lock);
+}
 
-free_all:
-    BN_free(e);
-    EVP_MD_CTX_destroy(p_ctx);
-    EVP_PKEY_free(key);
-    X509_EXTENSION_free(ext);
-    X509_free(x509);
+/* delete or archive certs not used in gc_days. Runs on startup, then at
+   most once a day */
+static void usage_gc(const char *pem_dir)
+{
+    char fname[PIXELSERV_MAX_PATH], archive[PIXELSERV_MAX_PATH];
+    char **old = NULL, **p;
+    time_t cutoff, now = time(NULL);
+    unsigned int idx;
+    int cnt = 0, size = 0, done = 0, i;
+    name_node *n;
+
+    if (usage.gc_days <= 0 || now - usage.last_gc < 86400)
+        return;
+    usage.last_gc = now;
+    cutoff = now - (time_t)usage.gc_days * 86400;
+
+    pthread_mutex_lock(&usage.lock);
+    for (idx = 0; usage.names.bucket && idx < usage.names.size; idx++)
+        for (n = usage.names.bucket[idx]; n; n = n->next) {
+            if (((usage_struct *)n->val)->last >= cutoff)
+                continue;
+            if (cnt == size) {
+                if ((p = realloc(old, (size ? size * 2 : 64) * sizeof(char *))) == NULL)
+                    break;
+                old = p;
+                size = size ? size * 2 : 64;
+            }
+            if ((old[cnt] = strdup(n->name)) != NULL)
+                cnt++;
+        }
+    pthread_mutex_unlock(&usage.lock);
+
+    snprintf(archive, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, PIXEL_ARCHIVE_DIR);
+    if (cnt && usage.gc_archive && mkdir(archive, 0700) < 0 && errno != EEXIST)
+        log_msg(LGG_ERR, "%s: failed to create %s: %m", __FUNCTION__, archive);
+    for (i = 0; i < cnt; i++) {
+        int rv;
+        snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, old[i]);
+        snprintf(archive, PIXELSERV_MAX_PATH, "%s/%s/%s", pem_dir, PIXEL_ARCHIVE_DIR, old[i]);
+        rv = usage.gc_archive ? rename(fname, archive) : unlink(fname);
+        if (rv == 0 || errno == ENOENT) {
+            cert_idx_del(old[i]);
+            cert_cache_drop(old[i]);
+            usage_del(old[i]);
+            done += (rv == 0);
+        } else
+            log_msg(LGG_ERR, "%s: failed to remove %s: %m", __FUNCTION__, fname);
+        free(old[i]);
+    }
+    free(old);
+    usage.cnt_gc += done;
+    if (done) {
+        prefetch_prune(pem_dir);
+        log_msg(LGG_NOTICE, "%s: %s %d certs unused for %d days", __FUNCTION__,
+                usage.gc_archive ? "archived" : "deleted", done, usage.gc_days);
+    }
 }
 
+static void der_tbl_unlink(der_cache_struct *e)
+{
+    if (e->prev) e->prev->next = e->next; else der_tbl.head = e->next;
+    if (e->next) e->next->prev = e->prev; else der_tbl.tail = e->prev;
+}
 
-static int pem_passwd_cb(char *buf, int size, int rwflag, void *u) { 
-    int rv = 0, fp;
-    char *fname = NULL; 
-    if (asprintf(&fname, "%s/ca.key.passphrase", (char*)u) < 0)
-        goto quit_cb;
+static void der_tbl_drop(der_cache_struct *e)
+{
+    der_tbl_unlink(e);
+    der_tbl.bytes -= e->bytes;
+    name_tbl_del(&der_tbl.idx, e->cert_name); /* frees e->cert_name */
+    free(e);
+}
 
-    if ((fp = open(fname, O_RDONLY)) < 0)
-        log_msg(LGG_ERR, "%s: failed to open ca.key.passphrase", __FUNCTION__);
-    else {
-        rv = read(fp, buf, size);
-        close(fp);
+/* keep DER encoded cert and key of an SSL_CTX evicted from sslctx_tbl */
+static void der_tbl_put(const char *cert_name, SSL_CTX *sslctx)
+{
+    X509 *x509 = SSL_CTX_get0_certificate(sslctx);
+    EVP_PKEY *key = SSL_CTX_get0_privatekey(sslctx);
+    der_cache_struct *e;
+    unsigned char *p;
+    int cert_len, key_len;
+
+    if (der_tbl.max_bytes <= 0 || x509 == NULL || key == NULL
+        || name_tbl_find(&der_tbl.idx, cert_name) != NULL
+        || (cert_len = i2d_X509(x509, NULL)) <= 0 || (key_len = key_der_len(key)) < 0
+        || (e = malloc(sizeof(der_cache_struct) + cert_len + key_len)) == NULL)
+        return;
+    p = e->der;
+    i2d_X509(x509, &p);
+    if (key_len > 0)
+        i2d_PrivateKey(key, &p);
+    e->cert_len = cert_len;
+    e->key_len = key_len;
+    e->bytes = sizeof(der_cache_struct) + cert_len + key_len + sizeof(name_node) + strlen(cert_name) + 1;
+    if (name_tbl_add(&der_tbl.idx, cert_name, (long)e) < 0) {
+        free(e);
+        return;
+    }
+    e->cert_name = name_tbl_find(&der_tbl.idx, cert_name)->name;
+    e->prev = NULL;
+    e->next = der_tbl.head;
+    if (der_tbl.head) der_tbl.head->prev = e; else der_tbl.tail = e;
+    der_tbl.head = e;
+    der_tbl.bytes += e->bytes;
+
+    while (der_tbl.bytes > der_tbl.max_bytes && der_tbl.tail != e)
+        der_tbl_drop(der_tbl.tail);
+}
+
+/* promote cert_name out of the DER tier. Costs a DER decode only */
+static int der_tbl_get(const char *cert_name, X509 **x509, EVP_PKEY **key)
+{
+    name_node *n;
+    der_cache_struct *e;
+    const unsigned char *p;
+
+    *x509 = NULL; *key = NULL;
+    if (der_tbl.idx.bucket == NULL || (n = name_tbl_find(&der_tbl.idx, cert_name)) == NULL)
+        return -1;
+    e = (der_cache_struct *)n->val;
+    p = e->der;
+    if ((*x509 = d2i_X509(NULL, &p, e->cert_len)) == NULL
+        || (*key = key_from_der(*x509, &p, e->key_len)) == NULL) {
+        X509_free(*x509);
+        *x509 = NULL;
+        der_tbl_drop(e);
+        return -1;
+    }
+    der_tbl_drop(e); /* the tiers are exclusive */
+    der_tbl.cnt_hit++;
+    return 0;
+}
+
+/* remove idx from sslctx_tbl, keeping the table sorted by name. Called
+   with sslctx_lock held */
+static void sslctx_tbl_drop(int idx)
+{
+    SSL_CTX_free(SSLCTX_TBL_get(idx, sslctx));
+    free(SSLCTX_TBL_get(idx, cert_name));
+    memmove(SSLCTX_TBL_ptr(idx), SSLCTX_TBL_ptr(idx + 1), (sslctx_tbl_end - idx - 1) * sizeof(sslctx_cache_struct));
+    sslctx_tbl_end--;
+    SSLCTX_TBL_set(sslctx_tbl_end, cert_name, NULL);
+    SSLCTX_TBL_set(sslctx_tbl_end, alloc_len, 0);
+    SSLCTX_TBL_set(sslctx_tbl_end, sslctx, NULL);
+}
+
+/* drop cert_name from both cache tiers, e.g. once removed from disk */
+static void cert_cache_drop(const char *cert_name)
+{
+    sslctx_cache_struct key, *found;
+    name_node *n;
+
+    key.cert_name = (char *)cert_name;
+    pthread_mutex_lock(&sslctx_lock);
+    if ((found = bsearch(&key, SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_certname)) != NULL)
+        sslctx_tbl_drop(found - SSLCTX_TBL_ptr(0));
+    if (der_tbl.idx.bucket && (n = name_tbl_find(&der_tbl.idx, cert_name)) != NULL)
+        der_tbl_drop((der_cache_struct *)n->val);
+    pthread_mutex_unlock(&sslctx_lock);
+}
+
+void der_tbl_init(int max_kb)
+{
+    der_tbl.max_bytes = (long)max_kb * 1024;
+    if (max_kb > 0 && name_tbl_init(&der_tbl.idx, 1024) < 0) {
+        log_msg(LGG_ERR, "Failed to allocate DER cert cache");
+        der_tbl.max_bytes = 0;
+    }
+}
+
+void der_tbl_cleanup()
+{
+    while (der_tbl.tail)
+        der_tbl_drop(der_tbl.tail);
+    name_tbl_free(&der_tbl.idx);
+}
+
+void sslctx_tbl_init(int tbl_size)
+{
+    if (tbl_size <= 0)
+        return;
+    sslctx_tbl_end = 0;
+    sslctx_tbl = malloc(tbl_size * sizeof(sslctx_cache_struct));
+    if (!sslctx_tbl) {
+        sslctx_tbl_size = 0;
+        log_msg(LGG_ERR, "Failed to allocate sslctx_tbl of size %d", tbl_size);
+    } else {
+        sslctx_tbl_size = tbl_size;
+        sslctx_tbl_cnt_hit = sslctx_tbl_cnt_miss = sslctx_tbl_cnt_purge = sslctx_tbl_last_flush = 0;
+        memset(sslctx_tbl, 0, tbl_size * sizeof(sslctx_cache_struct));
+    }
+    memset(&mrc, 0, sizeof(mrc));
+    mrc.threshold = MRC_HASH_MOD;
+    if ((mrc.stack = malloc(MRC_MAX_SAMPLES * sizeof(unsigned int))) == NULL)
+        log_msg(LGG_ERR, "Failed to allocate miss ratio curve samples");
+    pthread_mutex_init(&mrc.lock, NULL);
+}
+
+void sslctx_tbl_set_auto(int target, int max_kb)
+{
+    mrc.target = target;
+    mrc.max_size = (long)max_kb * 1024 / PIXEL_SSLCTX_EST_SIZE;
+    if (mrc.max_size < MRC_BUCKET_WIDTH)
+        mrc.max_size = MRC_BUCKET_WIDTH;
+}
+
+static int cmp_sslctx_last_use(const void *p1, const void *p2)
+{
+    /* most recently used first */
+    return ((sslctx_cache_struct *)p2)->last_use - ((sslctx_cache_struct *)p1)->last_use;
+}
+
+/* grow or shrink sslctx_tbl. least recently used entries are purged when
+   shrinking below the number of cached entries */
+static int sslctx_tbl_resize(int new_size)
+{
+    int idx;
+    sslctx_cache_struct *tbl;
+
+    if (new_size <= 0 || new_size == sslctx_tbl_size)
+        return -1;
+    if (new_size < sslctx_tbl_end) {
+        qsort(SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_last_use);
+        for (idx = new_size; idx < sslctx_tbl_end; idx++) {
+            der_tbl_put(SSLCTX_TBL_get(idx, cert_name), SSLCTX_TBL_get(idx, sslctx));
+            free(SSLCTX_TBL_get(idx, cert_name));
+            SSL_CTX_free(SSLCTX_TBL_get(idx, sslctx));
+            sslctx_tbl_cnt_purge++;
+        }
+        sslctx_tbl_end = new_size;
+        qsort(SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_certname);
+    }
+    if ((tbl = realloc(sslctx_tbl, new_size * sizeof(sslctx_cache_struct))) == NULL) {
+        log_msg(LGG_ERR, "%s: failed to resize sslctx_tbl to %d", __FUNCTION__, new_size);
+        return -1;
+    }
+    if (new_size > sslctx_tbl_size)
+        memset(tbl + sslctx_tbl_size, 0, (new_size - sslctx_tbl_size) * sizeof(sslctx_cache_struct));
+    log_msg(LGG_NOTICE, "%s: cert cache size %d -> %d", __FUNCTION__, sslctx_tbl_size, new_size);
+    sslctx_tbl = tbl;
+    sslctx_tbl_size = new_size;
+    return 0;
+}
+
+static unsigned int cert_name_hash(const char *str)
+{
+    /* FNV-1a followed by a murmur3 finalizer to spread low bits */
+    unsigned int h = 2166136261u;
+    for (; *str; str++)
+        h = (h ^ (unsigned char)*str) * 16777619u;
+    h ^= h >> 16; h *= 0x85ebca6b;
+    h ^= h >> 13; h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* drop the sampled names with the largest hash values and lower the
+   sampling threshold accordingly. Keeps the stack within MRC_MAX_SAMPLES */
+static void mrc_lower_threshold()
+{
+    int idx, keep;
+    unsigned int max = 0;
+    for (idx = 0; idx < mrc.depth; idx++)
+        if ((mrc.stack[idx] % MRC_HASH_MOD) > max)
+            max = mrc.stack[idx] % MRC_HASH_MOD;
+    mrc.threshold = max;
+    for (idx = 0, keep = 0; idx < mrc.depth; idx++)
+        if ((mrc.stack[idx] % MRC_HASH_MOD) < mrc.threshold)
+            mrc.stack[keep++] = mrc.stack[idx];
+    mrc.depth = keep;
+}
+
+static void mrc_record(const char *cert_name)
+{
+    unsigned int h = cert_name_hash(cert_name);
+    int pos;
+
+    if (mrc.stack == NULL || (h % MRC_HASH_MOD) >= mrc.threshold)
+        return;
+
+    pthread_mutex_lock(&mrc.lock);
+    float weight = (float)MRC_HASH_MOD / mrc.threshold;
+    for (pos = 0; pos < mrc.depth && mrc.stack[pos] != h; pos++);
+    if (pos < mrc.depth) {
+        /* pos distinct names were looked up since the last lookup of this name */
+        int bucket = pos * weight / MRC_BUCKET_WIDTH;
+        mrc.hist[(bucket < MRC_BUCKETS) ? bucket : MRC_BUCKETS] += weight;
+    } else {
+        mrc.cold += weight;
+        if (mrc.depth >= MRC_MAX_SAMPLES)
+            mrc_lower_threshold();
+        pos = mrc.depth;
+    }
+    mrc.total += weight;
+    if ((h % MRC_HASH_MOD) < mrc.threshold) {
+        if (pos == mrc.depth)
+            mrc.depth++;
+        memmove(mrc.stack + 1, mrc.stack, pos * sizeof(unsigned int));
+        mrc.stack[0] = h;
+    }
+    pthread_mutex_unlock(&mrc.lock);
+}
+
+/* smallest cache size whose estimated hit rate reaches target (in %) */
+static int mrc_size_for(int target)
+{
+    int b;
+    float hits = 0;
+    for (b = 0; b < MRC_BUCKETS; b++) {
+        hits += mrc.hist[b];
+        if (hits * 100 >= target * mrc.total)
+            break;
+    }
+    return (b + 1) * MRC_BUCKET_WIDTH;
+}
+
+static void mrc_auto_size()
+{
+    int new_size, b;
+
+    pthread_mutex_lock(&mrc.lock);
+    if (mrc.total < MRC_MIN_WEIGHT) {
+        pthread_mutex_unlock(&mrc.lock);
+        return;
+    }
+    new_size = mrc_size_for(mrc.target);
+    /* age the histogram so that the curve follows changes in traffic */
+    for (b = 0; b <= MRC_BUCKETS; b++)
+        mrc.hist[b] /= 2;
+    mrc.cold /= 2;
+    mrc.total /= 2;
+    pthread_mutex_unlock(&mrc.lock);
+
+    if (new_size > mrc.max_size)
+        new_size = mrc.max_size;
+    /* hysteresis: ignore changes within one bucket */
+    if (abs(new_size - sslctx_tbl_size) >= MRC_BUCKET_WIDTH)
+        sslctx_tbl_resize(new_size);
+}
+
+char* sslctx_tbl_get_mrc()
+{
+    char *buf = NULL, *line = NULL;
+    int b, last;
+    float hits = 0;
+
+    pthread_mutex_lock(&mrc.lock);
+    for (last = MRC_BUCKETS - 1; last > 0 && mrc.hist[last] == 0; last--);
+    if (asprintf(&buf, "# cert cache: size %d cached %d auto %s target %d%% max %d\n"
+            "# samples %d rate 1/%.1f refs %.0f cold %.0f\n# size\tmiss_ratio\n",
+            sslctx_tbl_size, sslctx_tbl_end, mrc.target ? "on" : "off", mrc.target, mrc.max_size,
+            mrc.depth, (float)MRC_HASH_MOD / mrc.threshold, mrc.total, mrc.cold) < 0)
+        buf = NULL;
+    for (b = 0; buf && b <= last + 1 && b < MRC_BUCKETS; b++) {
+        hits += mrc.hist[b];
+        if (asprintf(&line, "%s%d\t%.4f\n", buf, (b + 1) * MRC_BUCKET_WIDTH,
+                (mrc.total > 0) ? 1 - hits / mrc.total : 1.0) < 0)
+            line = NULL;
+        free(buf);
+        buf = line;
+    }
+    pthread_mutex_unlock(&mrc.lock);
+    return buf;
+}
+
+void sslctx_tbl_cleanup()
+{
+    int idx;
+    for (idx = 0; idx < sslctx_tbl_end; idx++) {
+        free(SSLCTX_TBL_get(idx, cert_name));
+        SSL_CTX_free(SSLCTX_TBL_get(idx, sslctx));
+    }
+    free(mrc.stack);
+    sess_cache_cleanup();
+}
+
+static int cmp_sslctx_certname(const void *k, const void *p)
+{
+    return strcmp(((sslctx_cache_struct *)k)->cert_name, ((sslctx_cache_struct *)p)->cert_name);
+}
+
+static int cmp_prefetch_reuse(const void *p1, const void *p2)
+{
+    const prefetch_struct *a = p1, *b = p2;
+    if (a->reuse_count != b->reuse_count)
+        return b->reuse_count - a->reuse_count;
+    if (a->last_use != b->last_use)
+        return (a->last_use < b->last_use) ? 1 : -1;
+    return a->line - b->line;
+}
+
+/* load the next prefetch entry until all are done or the cache is full.
+   Handshakes meanwhile load their certs on demand as usual */
+static void *prefetch_warmer(void *ptr)
+{
+    char fname[PIXELSERV_MAX_PATH];
+    int idx, full;
+
+    for (;;) {
+        pthread_mutex_lock(&prefetch.lock);
+        idx = prefetch.next++;
+        pthread_mutex_unlock(&prefetch.lock);
+        pthread_mutex_lock(&sslctx_lock);
+        full = (sslctx_tbl_end >= sslctx_tbl_size);
+        pthread_mutex_unlock(&sslctx_lock);
+        if (idx >= prefetch.cnt || full)
+            break;
+        snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", prefetch.pem_dir, prefetch.list[idx].name);
+        if (sslctx_tbl_warm(prefetch.list[idx].name, fname, prefetch.cachain, 0)) {
+            pthread_mutex_lock(&prefetch.lock);
+            prefetch.loaded++;
+            pthread_mutex_unlock(&prefetch.lock);
+            log_msg(LGG_DEBUG, "%s: %s", __FUNCTION__, prefetch.list[idx].name);
+        }
+    }
+    pthread_mutex_lock(&prefetch.lock);
+    if (--prefetch.threads == 0) {
+        log_msg(LGG_NOTICE, "%s: %d certs loaded in %.0f ms", __FUNCTION__, prefetch.loaded,
+                elapsed_time_msec(prefetch.start));
+        for (idx = 0; idx < prefetch.cnt; idx++)
+            free(prefetch.list[idx].name);
+        free(prefetch.list);
+        prefetch.list = NULL;
+    }
+    pthread_mutex_unlock(&prefetch.lock);
+    return NULL;
+}
+
+/* read pem_dir/prefetch and load its certs into the cache in the
+   background, most reused first, then most recently used */
+void sslctx_tbl_load(const char* pem_dir, const STACK_OF(X509_INFO) *cachain)
+{
+    FILE *fp;
+    char *fname = NULL, *line = NULL;
+    int size = 0, idx;
+
+    if ((line = malloc(PIXELSERV_MAX_PATH)) == NULL || (fname = malloc(PIXELSERV_MAX_PATH)) == NULL) {
+        log_msg(LGG_ERR, "%s: failed to allocate memory", __FUNCTION__);
+        goto quit_load;
+    }
+
+    (void)snprintf(fname, PIXELSERV_MAX_PATH, "%s/prefetch", pem_dir);
+    if((fp = fopen(fname, "r")) == NULL) {
+        log_msg(LGG_WARNING, "%s: %s doesn't exist.", __FUNCTION__, fname);
+        goto quit_load;
+    }
+
+    while (getline(&line, &(size_t){ PIXELSERV_MAX_PATH }, fp) != -1) {
+        char *cert_name = strtok(line, " \n\t"), *count = strtok(NULL, " \n\t"), *last = strtok(NULL, " \n\t");
+        prefetch_struct *p;
+
+        if (cert_name == NULL)
+            continue;
+        if (prefetch.cnt == size) {
+            if ((p = realloc(prefetch.list, (size ? size * 2 : 64) * sizeof(prefetch_struct))) == NULL)
+                break;
+            prefetch.list = p;
+            size = size ? size * 2 : 64;
+        }
+        p = &prefetch.list[prefetch.cnt];
+        p->reuse_count = count ? atoi(count) : 0;
+        p->last_use = last ? atol(last) : 0;
+        p->line = prefetch.cnt;
+        if ((p->name = strdup(cert_name)) != NULL)
+            prefetch.cnt++;
+    }
+    fclose(fp);
+    if (prefetch.cnt == 0)
+        goto quit_load;
+    qsort(prefetch.list, prefetch.cnt, sizeof(prefetch_struct), cmp_prefetch_reuse);
+
+    prefetch.pem_dir = pem_dir;
+    prefetch.cachain = cachain;
+    prefetch.threads = (gen_queue.workers < prefetch.cnt) ? gen_queue.workers : prefetch.cnt;
+    get_time(&prefetch.start);
+    for (idx = prefetch.threads; idx > 0; idx--) {
+        pthread_t warmer;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&warmer, &attr, prefetch_warmer, NULL)) {
+            log_msg(LGG_ERR, "%s: failed to create warm-up thread", __FUNCTION__);
+            pthread_mutex_lock(&prefetch.lock);
+            prefetch.threads--;
+            pthread_mutex_unlock(&prefetch.lock);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    log_msg(LGG_NOTICE, "%s: warming up %d certs with %d threads", __FUNCTION__, prefetch.cnt, prefetch.threads);
+quit_load:
+    free(fname);
+    free(line);
+}
+
+/* write list to pem_dir/prefetch in order, with a temp file and rename */
+static int prefetch_write(const char *pem_dir, const prefetch_struct *list, int cnt)
+{
+    char fname[PIXELSERV_MAX_PATH], tmp_fname[PIXELSERV_MAX_PATH];
+    int idx, rv = -1;
+    FILE *fp;
+
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/prefetch", pem_dir);
+    snprintf(tmp_fname, PIXELSERV_MAX_PATH, "%s/.prefetch.tmp", pem_dir);
+    pthread_mutex_lock(&checkpoint.file_lock);
+    if ((fp = fopen(tmp_fname, "w")) == NULL) {
+        log_msg(LGG_ERR, "%s: failed to open %s", __FUNCTION__, tmp_fname);
+        goto quit_write;
+    }
+    for (idx = 0; idx < cnt; idx++)
+        fprintf(fp, "%s\t%d\t%ld\n", list[idx].name, list[idx].reuse_count, (long)list[idx].last_use);
+    if (fclose(fp) != 0 || rename(tmp_fname, fname) != 0) {
+        log_msg(LGG_ERR, "%s: failed to write %s: %m", __FUNCTION__, fname);
+        unlink(tmp_fname);
+        goto quit_write;
+    }
+    rv = 0;
+quit_write:
+    pthread_mutex_unlock(&checkpoint.file_lock);
+    return rv;
+}
+
+/* snapshot names, reuse counts and last use of the cached certs under
+   sslctx_lock, then rank the copy and write it to pem_dir/prefetch with a
+   temp file and rename. The live table is left alone. With try_lock set,
+   give up if the lock is busy */
+static int sslctx_tbl_checkpoint(const char* pem_dir, int try_lock)
+{
+    prefetch_struct *snap = NULL;
+    time_t now = time(NULL);
+    unsigned int uptime = process_uptime();
+    int cnt = 0, idx, rv;
+
+    if (try_lock ? pthread_mutex_trylock(&sslctx_lock) : pthread_mutex_lock(&sslctx_lock))
+        return -1;
+    if (sslctx_tbl_end > 0 && (snap = malloc(sslctx_tbl_end * sizeof(prefetch_struct))) != NULL)
+        for (idx = 0; idx < sslctx_tbl_end; idx++) {
+            if ((snap[cnt].name = strdup(SSLCTX_TBL_get(idx, cert_name))) == NULL)
+                continue;
+            snap[cnt].reuse_count = SSLCTX_TBL_get(idx, reuse_count);
+            snap[cnt].last_use = now - (uptime - SSLCTX_TBL_get(idx, last_use));
+            snap[cnt].line = idx;
+            cnt++;
+        }
+    pthread_mutex_unlock(&sslctx_lock);
+    if (sslctx_tbl_end > 0 && snap == NULL) {
+        log_msg(LGG_ERR, "%s: failed to allocate memory", __FUNCTION__);
+        return -1;
+    }
+    qsort(snap, cnt, sizeof(prefetch_struct), cmp_prefetch_reuse);
+    rv = prefetch_write(pem_dir, snap, cnt);
+    for (idx = 0; idx < cnt; idx++)
+        free(snap[idx].name);
+    free(snap);
+    return rv;
+}
+
+/* on exit */
+void sslctx_tbl_save(const char* pem_dir)
+{
+    sslctx_tbl_checkpoint(pem_dir, 0);
+}
+
+void sslctx_tbl_lock(int idx)
+{
+    if (idx < 0 || idx >= sslctx_tbl_size) {
+        log_msg(LOG_DEBUG, "%s: invalid idx %d", __FUNCTION__, idx);
+        return;
+    }
+    pthread_mutex_lock(&SSLCTX_TBL_get(idx, lock));
+}
+
+void sslctx_tbl_unlock(int idx)
+{
+    if (idx < 0 || idx >= sslctx_tbl_size) {
+        log_msg(LOG_DEBUG, "%s: invalid idx %d", __FUNCTION__, idx);
+        return;
+    }
+    pthread_mutex_unlock(&SSLCTX_TBL_get(idx, lock));
+}
+
+/* resize sslctx_tbl in auto mode once enough lookups are sampled. Runs
+   in the background threads rather than in a handshake: a shrink purges
+   and DER encodes possibly hundreds of entries */
+static void sslctx_tbl_auto_size()
+{
+    pthread_mutex_lock(&sslctx_lock);
+    if (mrc.target && mrc.refs >= MRC_EVAL_REFS) {
+        mrc.refs = 0;
+        mrc_auto_size();
+    }
+    pthread_mutex_unlock(&sslctx_lock);
+}
+
+static int sslctx_tbl_check_and_flush(void)
+{
+    int pixel_now = process_uptime(), rv = -1;
+#ifdef DEBUG
+    printf("%s: now %d last_flush %d", __FUNCTION__, pixel_now, sslctx_tbl_last_flush);
+#endif
+
+    sslctx_tbl_auto_size();
+
+    /* flush at most every half of session timeout */
+    int do_flush = pixel_now - sslctx_tbl_last_flush - PIXEL_SSL_SESS_TIMEOUT / 2;
+    if (do_flush < 0) {
+        rv = -1;
+    } else {
+        sess_cache_flush(time(NULL));
+        sslctx_tbl_last_flush = pixel_now;
+        rv = 1;
+    }
+    return rv;
+}
+
+/* slot for a new entry: a free one or the least recently used */
+static int sslctx_tbl_ins_idx()
+{
+    int idx, purge_idx = 0; // decimate the first entry if no suitable candiate
+    int _last_use = process_uptime();
+
+    if (sslctx_tbl_end < sslctx_tbl_size)
+        return sslctx_tbl_end;
+    for (idx = 0; idx < sslctx_tbl_end; idx++) {
+        if (SSLCTX_TBL_get(idx, last_use) < _last_use) {
+            _last_use = SSLCTX_TBL_get(idx, last_use);
+            purge_idx = idx;
+        }
+    }
+    return purge_idx;
+}
+
+static int sslctx_tbl_lookup(char* cert_name, int* found_idx, int* ins_idx)
+{
+    *found_idx = -1; *ins_idx = -1;
+    if (!cert_name || !found_idx || !ins_idx) {
+        log_msg(LOG_ERR, "Invalid params. cert_name: %s. found_idx: %d, ins_idx: %d",
+            cert_name, found_idx, ins_idx);
+        return -1;
+    }
+
+    mrc_record(cert_name);
+    mrc.refs++; /* evaluated by sslctx_tbl_auto_size() */
+
+    sslctx_cache_struct key, *found;
+    key.cert_name = cert_name;
+    found = bsearch(&key, SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_certname);
+
+    if (found != NULL) {
+        sslctx_tbl_cnt_hit++;
+        found->reuse_count++;
+        found->last_use = process_uptime();
+        *found_idx = (found - SSLCTX_TBL_ptr(0));
+    } else
+        *ins_idx = sslctx_tbl_ins_idx();
+    return 0;
+}
+
+static int sslctx_tbl_insert(const char *cert_name, SSL_CTX *sslctx, int ins_idx)
+{
+    if (cert_name == NULL || sslctx == NULL || ins_idx >= sslctx_tbl_size || ins_idx < 0) {
+        log_msg(LOG_ERR, "Invalid params. cert_name: %s. sslctx: %d, ins_idx: %d",
+            cert_name, sslctx, ins_idx);
+        return -1;
+    }
+    sslctx_tbl_cnt_miss++;
+
+    if (ins_idx < sslctx_tbl_end)
+        der_tbl_put(SSLCTX_TBL_get(ins_idx, cert_name), SSLCTX_TBL_get(ins_idx, sslctx));
+
+    /* add new cache entry */
+    unsigned int pixel_now = process_uptime();
+    int len = strlen(cert_name);
+    char *str = SSLCTX_TBL_get(ins_idx, cert_name);
+    if ((len + 1) > SSLCTX_TBL_get(ins_idx, alloc_len)) {
+        str = realloc(str, len + 1);
+        SSLCTX_TBL_set(ins_idx, alloc_len, len + 1);
+    }
+    strncpy(str, cert_name, len + 1);
+    SSLCTX_TBL_set(ins_idx, cert_name, str);
+    SSLCTX_TBL_set(ins_idx, last_use, pixel_now);
+    SSLCTX_TBL_set(ins_idx, reuse_count, 0);
+    if (ins_idx == sslctx_tbl_end && sslctx_tbl_end < sslctx_tbl_size) {
+        sslctx_tbl_end++;
+    } else {
+#ifdef DEBUG
+        printf("%s: SSL_CTX_free %p sslctx_tbl_end %d\n", __FUNCTION__, SSLCTX_TBL_get(ins_idx, sslctx), sslctx_tbl_end);
+#endif
+        SSL_CTX_free(SSLCTX_TBL_get(ins_idx, sslctx));
+        sslctx_tbl_cnt_purge++;
+    }
+    SSLCTX_TBL_set(ins_idx, sslctx, sslctx);
+    return 0;
+}
+
+static int sslctx_tbl_cache(const char *cert_name, SSL_CTX *sslctx, int ins_idx)
+{   int ret = -1;
+    if (sslctx_tbl_insert(cert_name, sslctx, ins_idx) == 0) {
+        qsort(SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_certname);
+        ret = 0;
+    }
+    return ret;
+}
+
+/* status of cert_name in the negative cache, without counting a reject */
+static ssl_enum neg_tbl_peek(const char *cert_name)
+{
+    ssl_enum rv = SSL_UNKNOWN;
+    neg_cache_struct *e = &neg_tbl[cert_name_hash(cert_name) % PIXEL_NEG_TBL_SIZE];
+
+    pthread_mutex_lock(&neg_lock);
+    if (e->expire > process_uptime() && !strcmp(e->cert_name, cert_name))
+        rv = e->status;
+    pthread_mutex_unlock(&neg_lock);
+    return rv;
+}
+
+static ssl_enum neg_tbl_lookup(const char *cert_name)
+{
+    ssl_enum rv = neg_tbl_peek(cert_name);
+
+    if (rv != SSL_UNKNOWN) {
+        pthread_mutex_lock(&neg_lock);
+        if (rv == SSL_MISS)
+            neg_tbl_cnt_miss++;
+        else
+            neg_tbl_cnt_err++;
+        pthread_mutex_unlock(&neg_lock);
+    }
+    return rv;
+}
+
+static void neg_tbl_insert(const char *cert_name, ssl_enum status)
+{
+    if (strlen(cert_name) > PIXELSERV_MAX_SERVER_NAME)
+        return;
+    neg_cache_struct *e = &neg_tbl[cert_name_hash(cert_name) % PIXEL_NEG_TBL_SIZE];
+
+    pthread_mutex_lock(&neg_lock);
+    strcpy(e->cert_name, cert_name);
+    e->status = status;
+    e->expire = process_uptime() + ((status == SSL_MISS) ? PIXEL_NEG_TTL_MISS : PIXEL_NEG_TTL_ERR);
+    pthread_mutex_unlock(&neg_lock);
+}
+
+static void neg_tbl_remove(const char *cert_name)
+{
+    neg_cache_struct *e = &neg_tbl[cert_name_hash(cert_name) % PIXEL_NEG_TBL_SIZE];
+
+    pthread_mutex_lock(&neg_lock);
+    if (!strcmp(e->cert_name, cert_name))
+        e->expire = 0;
+    pthread_mutex_unlock(&neg_lock);
+}
+
+#ifdef DEBUG
+static void sslctx_tbl_dump(int idx, const char * func)
+{
+    printf("%s: idx %d now %d\n", func, idx, process_uptime());
+    printf("** cert_name %s\n", sslctx_tbl[idx].cert_name);
+    printf("** alloc_len %d\n", sslctx_tbl[idx].alloc_len);
+    printf("** last_use %d\n", sslctx_tbl[idx].last_use);
+    printf("** reuse_count %d\n", sslctx_tbl[idx].reuse_count);
+    printf("** sslctx %p\n", sslctx_tbl[idx].sslctx);
+}
+#endif
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static void ssl_lock_cb(int mode, int type, const char *file, int line)
+{
+    if (mode & CRYPTO_LOCK)
+        pthread_mutex_lock(&(locks[type]));
+    else
+        pthread_mutex_unlock(&(locks[type]));
+}
+#endif
+
+void ssl_thread_id(CRYPTO_THREADID *id)
+{
+    CRYPTO_THREADID_set_numeric(id, (unsigned long) pthread_self());
+}
+
+void ssl_init_locks()
+{
+#ifdef DEBUG
+    printf("%s: CRYPTO_num_locks = %d\n", __FUNCTION__, CRYPTO_num_locks());
+#endif
+    int i;
+    locks = (pthread_mutex_t *)OPENSSL_malloc(CRYPTO_num_locks()*sizeof(pthread_mutex_t));
+    for (i = 0; i < CRYPTO_num_locks(); i++)
+        pthread_mutex_init(&(locks[i]), NULL);
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+    CRYPTO_THREADID_set_callback((void (*)(CRYPTO_THREADID *)) ssl_thread_id);
+    CRYPTO_set_locking_callback((void (*)(int, int, const char *, int)) ssl_lock_cb);
+#endif
+}
+
+void ssl_free_locks()
+{
+    int i;
+    CRYPTO_set_locking_callback(NULL);
+    for (i = 0; i < CRYPTO_num_locks(); i++)
+        pthread_mutex_destroy(&(locks[i]));
+
+    OPENSSL_free(locks);
+}
+
+static EVP_PKEY* generate_key(leaf_key_enum type)
+{
+    EVP_PKEY *key = EVP_PKEY_new();
+
+    if (key == NULL)
+        return NULL;
+    if (type == LEAF_KEY_EC) {
+        EC_KEY *ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+        if (ec == NULL)
+            goto err;
+        EC_KEY_set_asn1_flag(ec, OPENSSL_EC_NAMED_CURVE);
+        if (!EC_KEY_generate_key(ec) || !EVP_PKEY_assign_EC_KEY(key, ec)) {
+            EC_KEY_free(ec);
+            goto err;
+        }
+    } else {
+        RSA *rsa = RSA_new();
+        BIGNUM *e = BN_new();
+        BN_set_word(e, RSA_F4);
+        if (RSA_generate_key_ex(rsa, 1024, e, NULL) <= 0 || !EVP_PKEY_assign_RSA(key, rsa)) {
+            BN_free(e);
+            RSA_free(rsa);
+            goto err;
+        }
+        BN_free(e); /* rsa will be freed when key is freed */
+    }
+    return key;
+err:
+    EVP_PKEY_free(key);
+    return NULL;
+}
+
+/* digest to sign certs with the CA key. Match the strength of P-384 */
+static const EVP_MD* ca_sign_md(EVP_PKEY *privkey)
+{
+    if (EVP_PKEY_base_id(privkey) == EVP_PKEY_EC && EVP_PKEY_bits(privkey) > 256)
+        return EVP_sha384();
+    return EVP_sha256();
+}
+
+static int key_matches_type(EVP_PKEY *key)
+{
+    return EVP_PKEY_base_id(key) == ((leaf_key_type == LEAF_KEY_EC) ? EVP_PKEY_EC : EVP_PKEY_RSA);
+}
+
+/* take a ready key out of the pool. NULL if the pool is empty */
+static EVP_PKEY* key_pool_get()
+{
+    EVP_PKEY *key = NULL;
+
+    pthread_mutex_lock(&key_pool.lock);
+    while (key_pool.cnt > 0 && key == NULL) {
+        key = key_pool.keys[--key_pool.cnt];
+        if (!key_matches_type(key)) {
+            EVP_PKEY_free(key);
+            key = NULL;
+        }
+    }
+    if (key == NULL && key_pool.size > 0)
+        key_pool.cnt_empty++;
+    pthread_mutex_unlock(&key_pool.lock);
+    return key;
+}
+
+static int key_pool_low()
+{
+    return key_pool.cnt < key_pool.size;
+}
+
+/* add one key to the pool. Called by the cert generator when idle */
+static void key_pool_refill()
+{
+    EVP_PKEY *key = generate_key(leaf_key_type);
+    unsigned int now_min = process_uptime() / 60;
+
+    if (key == NULL)
+        return;
+    pthread_mutex_lock(&key_pool.lock);
+    if (key_pool.cnt < key_pool.size) {
+        key_pool.keys[key_pool.cnt++] = key;
+        key = NULL;
+    }
+    if (now_min != key_pool.rate_min) {
+        key_pool.rate = (now_min == key_pool.rate_min + 1) ? key_pool.rate_cnt : 0;
+        key_pool.rate_min = now_min;
+        key_pool.rate_cnt = 0;
+    }
+    key_pool.rate_cnt++;
+    pthread_mutex_unlock(&key_pool.lock);
+    EVP_PKEY_free(key);
+}
+
+/* load keys saved by key_pool_save() if serving. The file is removed so
+   that a key is never handed out twice after a crash. One-shot runs
+   (-B, -Z, -G) leave it for the daemon */
+void key_pool_init(const char *pem_dir, int size, int serving)
+{
+    char fname[PIXELSERV_MAX_PATH];
+    EVP_PKEY *key;
+    FILE *fp;
+
+    if (size <= 0 || (key_pool.keys = calloc(size, sizeof(EVP_PKEY *))) == NULL)
+        return;
+    key_pool.size = size;
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, PIXEL_KEY_POOL_FILE);
+    if (!serving || (fp = fopen(fname, "r")) == NULL)
+        return;
+    while (key_pool.cnt < key_pool.size && (key = PEM_read_PrivateKey(fp, NULL, NULL, NULL)) != NULL) {
+        if (key_matches_type(key))
+            key_pool.keys[key_pool.cnt++] = key;
+        else
+            EVP_PKEY_free(key);
+    }
+    fclose(fp);
+    unlink(fname);
+    log_msg(LGG_NOTICE, "%s: %d keys loaded from %s", __FUNCTION__, key_pool.cnt, fname);
+}
+
+void key_pool_save(const char *pem_dir)
+{
+    char fname[PIXELSERV_MAX_PATH];
+    FILE *fp;
+    int fd, idx;
+
+    pthread_mutex_lock(&key_pool.lock);
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, PIXEL_KEY_POOL_FILE);
+    if (key_pool.cnt > 0
+        && ((fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 || (fp = fdopen(fd, "w")) == NULL))
+        log_msg(LGG_ERR, "%s: failed to open %s: %m", __FUNCTION__, fname);
+    else if (key_pool.cnt > 0) {
+        for (idx = 0; idx < key_pool.cnt; idx++)
+            PEM_write_PrivateKey(fp, key_pool.keys[idx], NULL, NULL, 0, NULL, NULL);
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&key_pool.lock);
+}
+
+void key_pool_cleanup()
+{
+    while (key_pool.cnt > 0)
+        EVP_PKEY_free(key_pool.keys[--key_pool.cnt]);
+    free(key_pool.keys);
+    key_pool.keys = NULL;
+    key_pool.size = 0;
+}
+
+/* "IP" for an IPv4 address, "DNS" otherwise */
+static const char *san_type(const char *name)
+{
+    const char *tld = NULL, *tld_tmp = strchr(name, '.');
+    int dot_count = 0;
+
+    while(tld_tmp != NULL) {
+        dot_count++;
+        tld = tld_tmp + 1;
+        tld_tmp = strchr(tld, '.');
+    }
+    return (dot_count == 3 && (atoi(tld) > 0 || (atoi(tld) == 0 && strlen(tld) == 1))) ? "IP" : "DNS";
+}
+
+static int str_set_cmp(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int str_set_has(const str_set *s, const char *str)
+{
+    return s->cnt && bsearch(&str, s->items, s->cnt, sizeof(char *), str_set_cmp) != NULL;
+}
+
+/* index the cnt strings packed in s->pool, sorted and without duplicates */
+static int str_set_index(str_set *s, int cnt)
+{
+    char *p;
+    int idx, uniq;
+
+    if (cnt == 0 || (s->items = malloc(cnt * sizeof(char *))) == NULL)
+        return -1;
+    for (p = s->pool, idx = 0; idx < cnt; p += strlen(p) + 1)
+        s->items[idx++] = p;
+    qsort(s->items, cnt, sizeof(char *), str_set_cmp);
+    for (idx = 1, uniq = 1; idx < cnt; idx++)
+        if (strcmp(s->items[idx], s->items[uniq - 1]))
+            s->items[uniq++] = s->items[idx];
+    s->cnt = uniq;
+    return 0;
+}
+
+static void str_set_free(str_set *s)
+{
+    free(s->items);
+    free(s->pool);
+    s->items = NULL;
+    s->pool = NULL;
+    s->cnt = 0;
+}
+
+/* the domains on one line of a hosts, dnsmasq, adblock or plain domain
+   list, lower-cased and checked. "*.a.com" is kept as is. Returns # of
+   domains in doms */
+static int blocklist_parse_line(char *line, char **doms)
+{
+    char *tok, *sav = NULL, *p;
+    int n = 0, i, cnt = 0;
+
+    if ((p = strchr(line, '#')) != NULL)
+        *p = '\0';
+    if (line[0] == '!' || line[0] == '[')
+        return 0; /* adblock comment or header */
+    if (!strncmp(line, "address=/", 9) || !strncmp(line, "server=/", 8) || !strncmp(line, "local=/", 7)) {
+        /* dnsmasq: address=/a.com/b.com/0.0.0.0. last field is not a domain */
+        int has_addr;
+        p = strchr(line, '/') + 1;
+        p[strcspn(p, " \t\r\n")] = '\0';
+        has_addr = (p[0] && p[strlen(p) - 1] != '/');
+        while ((tok = strtok_r(n ? NULL : p, "/", &sav)) != NULL && n < PIXEL_BLOCKLIST_LINE_DOMAINS)
+            doms[n++] = tok;
+        if (has_addr && n > 0)
+            n--;
+    } else if (!strncmp(line, "||", 2)) {
+        /* adblock: ||a.com^ */
+        if ((p = strchr(line, '^')) != NULL)
+            *p = '\0';
+        doms[n++] = line + 2;
+    } else {
+        /* hosts: 0.0.0.0 a.com b.com. list: a.com */
+        if ((tok = strtok_r(line, " \t\r\n", &sav)) == NULL)
+            return 0;
+        if (strspn(tok, "0123456789.") != strlen(tok) && strchr(tok, ':') == NULL)
+            doms[n++] = tok; /* not an address: a domain list */
+        while ((tok = strtok_r(NULL, " \t\r\n", &sav)) != NULL && n < PIXEL_BLOCKLIST_LINE_DOMAINS)
+            doms[n++] = tok;
+    }
+    for (i = 0; i < n; i++) {
+        char *d = doms[i] + strspn(doms[i], " \t.");
+        d[strcspn(d, " \t\r\n")] = '\0';
+        for (p = d; *p; p++)
+            *p = tolower((unsigned char)*p);
+        if (strlen(d) > PIXELSERV_MAX_SERVER_NAME || strchr(d, '.') == NULL
+            || strspn(d, "abcdefghijklmnopqrstuvwxyz0123456789.-_*") != strlen(d)
+            || (strchr(d, '*') && (strncmp(d, "*.", 2) || strchr(d + 1, '*'))))
+            continue;
+        doms[cnt++] = d;
+    }
+    return cnt;
+}
+
+/* build the allowlist from the blocklists. Swapped in whole, so that
+   handshakes see either the old or the new one */
+int allowlist_load()
+{
+    str_set *set, *old;
+    char *line = NULL, *doms[PIXEL_BLOCKLIST_LINE_DOMAINS];
+    size_t line_len = 0;
+    int idx, n, cnt = 0, size = 0, pool_size = 0;
+    FILE *fp;
+
+    if ((set = calloc(1, sizeof(str_set))) == NULL)
+        return -1;
+    for (idx = 0; idx < allowlist.file_cnt; idx++) {
+        if ((fp = fopen(allowlist.files[idx], "r")) == NULL) {
+            log_msg(LGG_ERR, "%s: failed to open %s: %m", __FUNCTION__, allowlist.files[idx]);
+            continue;
+        }
+        while (getline(&line, &line_len, fp) != -1)
+            for (n = blocklist_parse_line(line, doms); n > 0; n--) {
+                /* *.a.com: a.com and below, as for any name in the list */
+                char *d = doms[n - 1] + (doms[n - 1][0] == '*' ? 2 : 0);
+                int len = strlen(d) + 1;
+                if (size + len > pool_size) {
+                    char *pool = realloc(set->pool, pool_size ? pool_size * 2 : 65536);
+                    if (pool == NULL)
+                        break;
+                    set->pool = pool;
+                    pool_size = pool_size ? pool_size * 2 : 65536;
+                }
+                memcpy(set->pool + size, d, len);
+                size += len;
+                cnt++;
+            }
+        fclose(fp);
+    }
+    free(line);
+    if (str_set_index(set, cnt) < 0) {
+        log_msg(LGG_ERR, "%s: no domains loaded. all domains allowed", __FUNCTION__);
+        str_set_free(set);
+        free(set);
+        return -1;
+    }
+    pthread_rwlock_wrlock(&allowlist.lock);
+    old = allowlist.set;
+    allowlist.set = set;
+    pthread_rwlock_unlock(&allowlist.lock);
+    if (old) {
+        str_set_free(old);
+        free(old);
+    }
+    log_msg(LGG_NOTICE, "%s: %d domains in %d KB", __FUNCTION__, set->cnt,
+            (int)((size + set->cnt * sizeof(char *)) / 1024));
+    return 0;
+}
+
+int allowlist_init(char **files, int file_cnt)
+{
+    allowlist.files = files;
+    allowlist.file_cnt = file_cnt;
+    if (pipe(allowlist.reload_pipe) == 0) {
+        fcntl(allowlist.reload_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(allowlist.reload_pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(allowlist.reload_pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(allowlist.reload_pipe[1], F_SETFD, FD_CLOEXEC);
+    }
+    return allowlist_load();
+}
+
+/* async-signal-safe. cert_generator reloads the allowlist */
+void allowlist_reload_request()
+{
+    if (allowlist.reload_pipe[1] >= 0 && write(allowlist.reload_pipe[1], "r", 1) < 0)
+        ; /* a reload is pending already */
+}
+
+/* 1 if srv_name or one of its parent domains is in the allowlist, or if
+   there is no allowlist */
+static int allowlist_match(const char *srv_name)
+{
+    char name[PIXELSERV_MAX_SERVER_NAME + 1];
+    const char *s;
+    int i, rv = 0;
+
+    if (allowlist.set == NULL)
+        return 1;
+    for (i = 0; srv_name[i] && i < PIXELSERV_MAX_SERVER_NAME; i++)
+        name[i] = tolower((unsigned char)srv_name[i]);
+    name[i] = '\0';
+    pthread_rwlock_rdlock(&allowlist.lock);
+    for (s = name; s && !rv; s = strchr(s, '.'), s = s ? s + 1 : NULL)
+        rv = str_set_has(allowlist.set, s);
+    pthread_rwlock_unlock(&allowlist.lock);
+    return rv;
+}
+
+void allowlist_cleanup()
+{
+    if (allowlist.set) {
+        str_set_free(allowlist.set);
+        free(allowlist.set);
+        allowlist.set = NULL;
+    }
+}
+
+static int psl_has(const char *rule)
+{
+    return str_set_has(&psl, rule);
+}
+
+/* length of the public suffix of lower-case name, by the PSL algorithm:
+   the longest matching rule wins, an exception rule over a wildcard one,
+   and the TLD if no rule matches */
+static int psl_suffix_len(const char *name)
+{
+    char rule[PIXELSERV_MAX_SERVER_NAME + 3];
+    const char *s, *parent;
+
+    for (s = name; s; s = (parent ? parent + 1 : NULL)) {
+        parent = strchr(s, '.');
+        snprintf(rule, sizeof(rule), "!%s", s);
+        if (psl_has(rule))
+            return parent ? strlen(parent + 1) : 0;
+        if (psl_has(s))
+            return strlen(s);
+        if (parent) {
+            snprintf(rule, sizeof(rule), "*%s", parent);
+            if (psl_has(rule))
+                return strlen(s);
+        }
+    }
+    s = strrchr(name, '.');
+    return s ? strlen(s + 1) : strlen(name);
+}
+
+/* load the Public Suffix List from file. Rules are kept in one string pool
+   with a sorted index for bsearch() */
+int psl_init(const char *file)
+{
+    struct stat st;
+    FILE *fp;
+    char line[256], *p;
+    int len, size = 0, cnt = 0;
+
+    if ((fp = fopen(file, "r")) == NULL || fstat(fileno(fp), &st) < 0) {
+        log_msg(LGG_ERR, "%s: failed to open %s: %m", __FUNCTION__, file);
+        if (fp)
+            fclose(fp);
+        return -1;
+    }
+    /* rules take less room than the file */
+    if ((psl.pool = malloc(st.st_size + 1)) == NULL)
+        goto quit_err;
+    while (fgets(line, sizeof(line), fp)) {
+        if (line[0] == '/' || (p = strtok(line, " \t\r\n")) == NULL)
+            continue;
+        len = strlen(p) + 1;
+        if (size + len > st.st_size + 1)
+            break;
+        for (; *p; p++)
+            psl.pool[size++] = tolower((unsigned char)*p);
+        psl.pool[size++] = '\0';
+        cnt++;
+    }
+    if (str_set_index(&psl, cnt) < 0)
+        goto quit_err;
+    fclose(fp);
+    log_msg(LGG_NOTICE, "%s: %d rules loaded from %s", __FUNCTION__, psl.cnt, file);
+    return 0;
+
+quit_err:
+    log_msg(LGG_ERR, "%s: failed to load %s", __FUNCTION__, file);
+    fclose(fp);
+    psl_cleanup();
+    return -1;
+}
+
+void psl_cleanup()
+{
+    str_set_free(&psl);
+}
+
+/* cert name for server name srv_name: "_.b.c" for the wildcard covering
+   a.b.c. Names of two labels or less and IPv4 addresses are kept as is.
+   With the PSL loaded, names whose parent is a public suffix, such as
+   example.co.uk, are kept as is too: browsers reject *.co.uk.
+   Returns the length of the cert name, as snprintf() */
+static int cert_name_for(const char *srv_name, char *cert_name, size_t size)
+{
+    int dot_count = 0;
+    const char *tld = NULL, *p = strchr(srv_name, '.');
+
+    while(p){
+        dot_count++;
+        tld = p + 1;
+        p = strchr(tld, '.');
+    }
+    if (dot_count <= 1 || (dot_count == 3 && atoi(tld) > 0))
+        return snprintf(cert_name, size, "%s", srv_name);
+    if (psl.cnt && strlen(srv_name) <= PIXELSERV_MAX_SERVER_NAME) {
+        char name[PIXELSERV_MAX_SERVER_NAME + 1];
+        int i;
+        for (i = 0; srv_name[i]; i++)
+            name[i] = tolower((unsigned char)srv_name[i]);
+        name[i] = '\0';
+        if (psl_suffix_len(name) >= strlen(strchr(name, '.') + 1))
+            return snprintf(cert_name, size, "%s", srv_name);
+    }
+    return snprintf(cert_name, size, "_%s", strchr(srv_name, '.'));
+}
+
+static bundle_struct *bundle_by_name(const char *cert_name)
+{
+    int i;
+    for (i = 0; i < bundles.cnt; i++)
+        if (!strcmp(bundles.list[i].name, cert_name))
+            return &bundles.list[i];
+    return NULL;
+}
+
+/* cert name of the bundle covering cert_name. NULL if none */
+static const char *bundle_lookup(const char *cert_name)
+{
+    name_node *n;
+
+    if (bundles.cnt == 0 || (n = name_tbl_find(&bundles.members, cert_name)) == NULL)
+        return NULL;
+    return bundles.list[n->val].name;
+}
+
+/* load bundles from pem_dir. Each line is a bundle name followed by the
+   names it covers, e.g. "doubleclick doubleclick.net *.doubleclick.net".
+   The bundle cert is named "+NAME.HASH" where HASH covers the names, so a
+   changed line gets a new cert */
+int bundle_init(const char *pem_dir)
+{
+    char fname[PIXELSERV_MAX_PATH], line[PIXEL_BUNDLE_LINE_MAX];
+    FILE *fp;
+    int lineno = 0;
+
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, PIXEL_BUNDLE_FILE);
+    if ((fp = fopen(fname, "r")) == NULL)
+        return 0;
+    if (name_tbl_init(&bundles.members, PIXEL_BUNDLE_MAX * 8) < 0) {
+        fclose(fp);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) && bundles.cnt < PIXEL_BUNDLE_MAX) {
+        char *tok, *sav = NULL, *name;
+        bundle_struct *b = &bundles.list[bundles.cnt];
+        unsigned int h = 0;
+        int san_len = 0, cnt = 0;
+
+        lineno++;
+        if (strchr(line, '\n') == NULL && !feof(fp)) {
+            int c;
+            log_msg(LGG_ERR, "%s: %s line %d: line too long", __FUNCTION__, fname, lineno);
+            while ((c = fgetc(fp)) != EOF && c != '\n');
+            continue;
+        }
+        if ((name = strtok_r(line, " \t\r\n", &sav)) == NULL || name[0] == '#')
+            continue;
+        if (strlen(name) > PIXEL_BUNDLE_NAME_MAX) {
+            log_msg(LGG_ERR, "%s: %s line %d: name too long", __FUNCTION__, fname, lineno);
+            continue;
+        }
+        b->san = malloc(PIXEL_BUNDLE_LINE_MAX * 2);
+        b->cn[0] = '\0';
+        while ((tok = strtok_r(NULL, " \t\r\n", &sav)) != NULL && b->san) {
+            char member[PIXELSERV_MAX_SERVER_NAME + 2];
+            name_node *n;
+            int len;
+            if (strlen(tok) > PIXELSERV_MAX_SERVER_NAME)
+                continue;
+            /* a.b.c is served by the cert of *.b.c. same for a bundle */
+            if (tok[0] == '*')
+                snprintf(member, sizeof(member), "_%s", tok + 1);
+            else
+                cert_name_for(tok, member, sizeof(member));
+            if ((n = name_tbl_find(&bundles.members, member)) && n->val == bundles.cnt)
+                continue; /* covered already */
+            if (member[0] == '_')
+                member[0] = '*';
+            len = snprintf(b->san + san_len, PIXEL_BUNDLE_LINE_MAX * 2 - san_len, "%s%s:%s",
+                           cnt ? "," : "", san_type(member), member);
+            if (len >= PIXEL_BUNDLE_LINE_MAX * 2 - san_len) {
+                b->san[san_len] = '\0';
+                log_msg(LGG_ERR, "%s: %s line %d: too many names. %s and later ignored",
+                        __FUNCTION__, fname, lineno, tok);
+                break;
+            }
+            san_len += len;
+            if (cnt++ == 0)
+                strcpy(b->cn, member);
+            if (member[0] == '*')
+                member[0] = '_';
+            if (name_tbl_add(&bundles.members, member, bundles.cnt) < 0)
+                break;
+            h = h * 31 + cert_name_hash(member);
+        }
+        if (cnt == 0 || b->san == NULL) {
+            free(b->san);
+            continue;
+        }
+        snprintf(b->name, sizeof(b->name), "+%s.%08x", name, h);
+        log_msg(LGG_INFO, "%s: %s covers %d names", __FUNCTION__, b->name, cnt);
+        bundles.cnt++;
+    }
+    fclose(fp);
+    log_msg(LGG_NOTICE, "%s: %d bundles loaded from %s", __FUNCTION__, bundles.cnt, fname);
+    return bundles.cnt;
+}
+
+void bundle_cleanup()
+{
+    int i;
+    for (i = 0; i < bundles.cnt; i++)
+        free(bundles.list[i].san);
+    bundles.cnt = 0;
+    name_tbl_free(&bundles.members);
+}
+
+/* write to a temp file and rename, so that a cert on disk is never
+   half written even if we are killed */
+static int cert_write_pem(const char *dir, const char *cert_name, X509 *x509, EVP_PKEY *key)
+{
+    char fname[PIXELSERV_MAX_PATH], tmp_fname[PIXELSERV_MAX_PATH];
+    FILE *fp;
+    int fd;
+
+    snprintf(tmp_fname, PIXELSERV_MAX_PATH, "%s/.%s.tmp", dir, cert_name);
+    if ((fd = open(tmp_fname, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, 0666)) < 0
+        || (fp = fdopen(fd, "wb")) == NULL) {
+        log_msg(LGG_ERR, "%s: failed to open file for write: %s", __FUNCTION__, tmp_fname);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    PEM_write_X509(fp, x509);
+    if (key != shared_key)
+        PEM_write_PrivateKey(fp, key, NULL, NULL, 0, NULL, NULL);
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", dir, cert_name);
+    if (fclose(fp) != 0 || rename(tmp_fname, fname) != 0) {
+        log_msg(LGG_ERR, "%s: failed to write %s: %m", __FUNCTION__, fname);
+        unlink(tmp_fname);
+        return -1;
+    }
+    return 0;
+}
+
+/* move staged certs at least delay seconds old, or all if force, into
+   CERT_PATH. Returns the number of certs moved */
+static int cert_stage_flush(const char *pem_dir, int force)
+{
+    char *batch[PIXEL_STAGE_BATCH], fname[PIXELSERV_MAX_PATH];
+    long now = process_uptime();
+    unsigned int idx;
+    name_node *n;
+    int cnt = 0, done = 0, i;
+
+    pthread_mutex_lock(&cert_stage.lock);
+    for (idx = 0; cert_stage.names.bucket && idx < cert_stage.names.size && cnt < PIXEL_STAGE_BATCH; idx++)
+        for (n = cert_stage.names.bucket[idx]; n && cnt < PIXEL_STAGE_BATCH; n = n->next)
+            if ((force || now - n->val >= cert_stage.delay) && (batch[cnt] = strdup(n->name)) != NULL)
+                cnt++;
+    pthread_mutex_unlock(&cert_stage.lock);
+
+    for (i = 0; i < cnt; i++) {
+        X509 *x509;
+        EVP_PKEY *key;
+        int rv = -1;
+
+        snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", cert_stage.dir, batch[i]);
+        if (cert_read_pem(fname, &x509, &key) < 0)
+            log_msg(LGG_ERR, "%s: dropped unreadable %s", __FUNCTION__, fname);
+        else if (cert_store.fd >= 0)
+            rv = cert_store_append(batch[i], x509, key);
+        else if ((rv = cert_write_pem(pem_dir, batch[i], x509, key)) == 0)
+            cert_idx_add(batch[i]);
+        if (x509 == NULL || rv == 0) {
+            pthread_mutex_lock(&cert_stage.lock);
+            name_tbl_del(&cert_stage.names, batch[i]);
+            unlink(fname);
+            pthread_mutex_unlock(&cert_stage.lock);
+            done += (rv == 0);
+        } /* else retried on the next round */
+        X509_free(x509);
+        EVP_PKEY_free(key);
+        free(batch[i]);
+    }
+    cert_stage.cnt_flushed += done;
+    if (done)
+        log_msg(LGG_INFO, "%s: %d certs flushed to %s", __FUNCTION__, done, pem_dir);
+    return done;
+}
+
+/* stage new certs in stage_dir for delay seconds. The dir must be a real
+   dir private to us since we unlink and read certs in it, possibly as
+   root. Certs left there by a previous run are flushed first thing */
+int cert_stage_init(int delay, const char *stage_dir, uid_t uid, gid_t gid)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct stat st;
+    char fname[PIXELSERV_MAX_PATH];
+    int fd;
+
+    if (delay <= 0)
+        return 0;
+    if (stage_dir == NULL || (cert_stage.dir = strdup(stage_dir)) == NULL) {
+        log_msg(LGG_ERR, "%s: failed to allocate memory", __FUNCTION__);
+        return -1;
+    }
+    if ((mkdir(cert_stage.dir, 0700) < 0 && errno != EEXIST)
+        || (fd = open(cert_stage.dir, O_RDONLY | O_DIRECTORY | O_NOFOLLOW)) < 0) {
+        log_msg(LGG_ERR, "%s: failed to open %s: %m", __FUNCTION__, cert_stage.dir);
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISDIR(st.st_mode) || (st.st_mode & 0777) != 0700
+        || (st.st_uid != geteuid() && st.st_uid != uid)) {
+        log_msg(LGG_ERR, "%s: %s must be a dir owned by us with mode 0700", __FUNCTION__, cert_stage.dir);
+        close(fd);
+        return -1;
+    }
+    if ((st.st_uid != uid || st.st_gid != gid) && fchown(fd, uid, gid) < 0) {
+        log_msg(LGG_ERR, "%s: failed to set owner of %s: %m", __FUNCTION__, cert_stage.dir);
+        close(fd);
+        return -1;
+    }
+    if ((dir = fdopendir(fd)) == NULL || name_tbl_init(&cert_stage.names, 64) < 0) {
+        log_msg(LGG_ERR, "%s: failed to open %s: %m", __FUNCTION__, cert_stage.dir);
+        if (dir)
+            closedir(dir);
+        else
+            close(fd);
+        return -1;
+    }
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] != '.')
+            name_tbl_add(&cert_stage.names, de->d_name, -(long)delay);
+        else if (strcmp(de->d_name, ".") && strcmp(de->d_name, "..")) {
+            /* temp file of an interrupted write */
+            snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", cert_stage.dir, de->d_name);
+            unlink(fname);
+        }
+    }
+    closedir(dir);
+    if (cert_stage.names.cnt)
+        log_msg(LGG_NOTICE, "%s: %d staged certs recovered from %s", __FUNCTION__,
+                cert_stage.names.cnt, cert_stage.dir);
+    cert_stage.delay = delay;
+    return 0;
+}
+
+/* on exit: flush everything once the flusher is done with its batch.
+   Anything left stays staged for the next run */
+void cert_stage_save(const char *pem_dir)
+{
+    if (cert_stage.delay <= 0)
+        return;
+    pthread_mutex_lock(&cert_stage.flush_lock);
+    while (cert_stage_flush(pem_dir, 1) == PIXEL_STAGE_BATCH);
+    pthread_mutex_unlock(&cert_stage.flush_lock);
+}
+
+void cert_stage_cleanup()
+{
+    name_tbl_free(&cert_stage.names);
+}
+
+static void generate_cert(char* pem_fn, const char *pem_dir, X509_NAME *issuer, EVP_PKEY *privkey)
+{
+    EVP_PKEY *key = NULL;
+    X509 *x509 = NULL;
+    X509_EXTENSION *ext = NULL;
+    X509V3_CTX ext_ctx;
+#define SAN_STR_SIZE PIXELSERV_MAX_SERVER_NAME + 4 /* max("IP:", "DNS:") = 4 */
+    char san_str[SAN_STR_SIZE];
+    bundle_struct *b = NULL;
+    EVP_MD_CTX *p_ctx = NULL;
+
+    p_ctx = EVP_MD_CTX_create();
+    if(EVP_DigestSignInit(p_ctx, NULL, ca_sign_md(privkey), NULL, privkey) != 1)
+        log_msg(LGG_ERR, "%s: failed to init sign context", __FUNCTION__);
+
+    if (pem_fn[0] == '+' && (b = bundle_by_name(pem_fn)) == NULL) {
+        log_msg(LGG_ERR, "%s: unknown bundle %s", __FUNCTION__, pem_fn);
+        goto free_all;
+    }
+    if(pem_fn[0] == '_') pem_fn[0] = '*';
+
+    // -- generate cert
+    if (shared_key) {
+        EVP_PKEY_up_ref(shared_key);
+        key = shared_key;
+    } else if ((key = key_pool_get()) == NULL && (key = generate_key(leaf_key_type)) == NULL)
+        goto free_all;
+#ifdef DEBUG
+    printf("%s: %s key generated for [%s]\n", __FUNCTION__, leaf_key_name[leaf_key_type], pem_fn);
+#endif
+    if((x509 = X509_new()) == NULL)
+        goto free_all;
+    ASN1_INTEGER_set(X509_get_serialNumber(x509),rand());
+    X509_set_version(x509,2); // X509 v3
+    X509_gmtime_adj(X509_get_notBefore(x509), 0);
+    X509_gmtime_adj(X509_get_notAfter(x509), 315360000L); // cert valid for 10yrs
+    X509_set_issuer_name(x509, issuer);
+    X509_NAME *name = X509_get_subject_name(x509);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (unsigned char *)(b ? b->cn : pem_fn), -1, -1, 0);
+    X509V3_set_ctx_nodb(&ext_ctx);
+
+    snprintf(san_str, SAN_STR_SIZE, "%s:%s", san_type(pem_fn), pem_fn);
+    if ((ext = X509V3_EXT_conf_nid(NULL, &ext_ctx, NID_subject_alt_name, b ? b->san : san_str)) == NULL)
+        goto free_all;
+    X509_add_ext(x509, ext, -1);
+    X509_set_pubkey(x509, key);
+    X509_sign_ctx(x509, p_ctx);
+#ifdef DEBUG
+    printf("%s: x509 cert created\n", __FUNCTION__);
+#endif
+
+    // -- save cert
+    if(pem_fn[0] == '*')
+        pem_fn[0] = '_';
+    if (cert_stage.delay > 0 && cert_write_pem(cert_stage.dir, pem_fn, x509, key) == 0) {
+        pthread_mutex_lock(&cert_stage.lock);
+        name_tbl_add(&cert_stage.names, pem_fn, process_uptime());
+        pthread_mutex_unlock(&cert_stage.lock);
+        usage_touch(pem_fn, 0);
+        log_msg(LGG_NOTICE, "cert generated to staging: %s", pem_fn);
+        goto free_all;
+    }
+    if (cert_store.fd >= 0) {
+        if (cert_store_append(pem_fn, x509, key) == 0) {
+            usage_touch(pem_fn, 0);
+            log_msg(LGG_NOTICE, "cert generated to store: %s", pem_fn);
+        }
+        goto free_all;
+    }
+    if (cert_write_pem(pem_dir, pem_fn, x509, key) == 0) {
+        cert_idx_add(pem_fn);
+        usage_touch(pem_fn, 0);
+        log_msg(LGG_NOTICE, "cert generated to disk: %s", pem_fn);
+    }
+
+free_all:
+    EVP_MD_CTX_destroy(p_ctx);
+    EVP_PKEY_free(key);
+    X509_EXTENSION_free(ext);
+    X509_free(x509);
+}
+
+
+static int pem_passwd_cb(char *buf, int size, int rwflag, void *u) { 
+    int rv = 0, fp;
+    char *fname = NULL; 
+    if (asprintf(&fname, "%s/ca.key.passphrase", (char*)u) < 0)
+        goto quit_cb;
+
+    if ((fp = open(fname, O_RDONLY)) < 0)
+        log_msg(LGG_ERR, "%s: failed to open ca.key.passphrase", __FUNCTION__);
+    else {
+        rv = read(fp, buf, size);
+        close(fp);
+#ifdef DEBUG
+        buf[rv] = '\0';
+        printf("%s: %d, %d\n", buf, size, rv);
+#endif
+    }
+
+quit_cb:
+    free(fname);
+    return --rv; // trim \n at the end
+}
+
+void cert_gen_set_deadline(int msec)
+{
+    cert_gen_deadline = msec;
+}
+
+void cert_gen_set_key_type(leaf_key_enum type)
+{
+    leaf_key_type = type;
+}
+
+/* load the shared leaf key from pem_dir. Generated on first use or when
+   its type differs from -K */
+int shared_key_init(const char *pem_dir)
+{
+    char fname[PIXELSERV_MAX_PATH];
+    FILE *fp;
+    int fd;
+
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, PIXEL_SHARED_KEY_FILE);
+    if ((fp = fopen(fname, "r")) != NULL) {
+        shared_key = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+        fclose(fp);
+        if (shared_key && !key_matches_type(shared_key)) {
+            EVP_PKEY_free(shared_key);
+            shared_key = NULL;
+        }
+    }
+    if (shared_key)
+        return 0;
+    if ((shared_key = generate_key(leaf_key_type)) == NULL) {
+        log_msg(LGG_ERR, "%s: failed to generate shared key", __FUNCTION__);
+        return -1;
+    }
+    if ((fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0 || (fp = fdopen(fd, "w")) == NULL) {
+        log_msg(LGG_ERR, "%s: failed to open %s: %m", __FUNCTION__, fname);
+        return -1;
+    }
+    PEM_write_PrivateKey(fp, shared_key, NULL, NULL, 0, NULL, NULL);
+    fclose(fp);
+    log_msg(LGG_NOTICE, "%s: new %s shared key saved to %s", __FUNCTION__, leaf_key_name[leaf_key_type], fname);
+    return 0;
+}
+
+void shared_key_cleanup()
+{
+    EVP_PKEY_free(shared_key);
+    shared_key = NULL;
+}
+
+void cert_tlstor_init(const char *pem_dir, cert_tlstor_t *ct)
+{
+    FILE *fp;
+    char cert_file[PIXELSERV_MAX_PATH];
+    X509 *x509 = X509_new();
+
+    memset(ct, 0, sizeof(cert_tlstor_t));
+    snprintf(cert_file, PIXELSERV_MAX_PATH, "%s/ca.crt", pem_dir);
+    fp = fopen(cert_file, "r");
+
+    if(!fp || !PEM_read_X509(fp, &x509, NULL, NULL))
+       log_msg(LGG_ERR, "%s: failed to load ca.crt", __FUNCTION__);
+    else {
+        char *cafile;
+        int fsz;
+        BIO *bioin;
+        EVP_PKEY *pubkey = X509_get_pubkey(x509);
+
+        if (fseek(fp, 0L, SEEK_END) < 0)
+            log_msg(LGG_ERR, "%s: failed to seek ca.crt", __FUNCTION__);
+
+        fsz = ftell(fp);
+        cafile = malloc(fsz);
+        fseek(fp, 0L, SEEK_SET);
+        fsz = fread(cafile, 1, fsz, fp);
+
+        bioin = BIO_new_mem_buf(cafile, fsz);
+        if (!bioin)
+            log_msg(LGG_ERR, "%s: failed to create BIO mem buffer", __FUNCTION__);
+
+        ct->pem_dir = pem_dir;
+        ct->cachain = PEM_X509_INFO_read_bio(bioin, NULL, NULL, NULL);
+        ct->issuer = X509_NAME_dup(X509_get_subject_name(x509));
+
+        if (ct->cachain == NULL)
+            log_msg(LGG_ERR, "%s: failed to read CA chains", __FUNCTION__);
+
+        BIO_free(bioin);
+        EVP_PKEY_free(pubkey);
+        free(cafile);
+        fclose(fp);
+    }
+
+    snprintf(cert_file, PIXELSERV_MAX_PATH, "%s/ca.key", pem_dir);
+    fp = fopen(cert_file, "r");
+
+    /* RSA or ECDSA, in traditional or PKCS#8 format */
+    if(!fp || (ct->privkey = PEM_read_PrivateKey(fp, NULL, pem_passwd_cb, (void*)pem_dir)) == NULL)
+        log_msg(LGG_ERR, "%s: failed to load ca.key", __FUNCTION__);
+    else {
+        if (ct->issuer && X509_check_private_key(x509, ct->privkey) != 1)
+            log_msg(LGG_ERR, "%s: ca.key does not match ca.crt", __FUNCTION__);
+        log_msg(LGG_INFO, "%s: %s CA key of %d bits", __FUNCTION__,
+            (EVP_PKEY_base_id(ct->privkey) == EVP_PKEY_EC) ? "ECDSA" : "RSA", EVP_PKEY_bits(ct->privkey));
+    }
+    if (fp)
+        fclose(fp);
+    X509_free(x509);
+}
+
+void cert_tlstor_cleanup(cert_tlstor_t *c)
+{
+    sk_X509_INFO_pop_free(c->cachain, X509_INFO_free);
+    X509_NAME_free(c->issuer);
+    EVP_PKEY_free(c->privkey);
+}
+
+/* gen_queue is a max-heap on (prio, -seq): most missed names first, then
+   first come first served */
+static int gen_queue_higher(int a, int b)
+{
+    const gen_queue_struct *x = &gen_queue.heap[a], *y = &gen_queue.heap[b];
+    return x->prio > y->prio || (x->prio == y->prio && (int)(x->seq - y->seq) < 0);
+}
+
+static void gen_queue_swap(int a, int b)
+{
+    gen_queue_struct tmp = gen_queue.heap[a];
+    gen_queue.heap[a] = gen_queue.heap[b];
+    gen_queue.heap[b] = tmp;
+    name_tbl_find(&gen_queue.names, gen_queue.heap[a].name)->val = a;
+    name_tbl_find(&gen_queue.names, gen_queue.heap[b].name)->val = b;
+}
+
+static void gen_queue_sift_up(int idx)
+{
+    while (idx > 0 && gen_queue_higher(idx, (idx - 1) / 2)) {
+        gen_queue_swap(idx, (idx - 1) / 2);
+        idx = (idx - 1) / 2;
+    }
+}
+
+static void gen_queue_sift_down(int idx)
+{
+    for (;;) {
+        int top = idx, l = 2 * idx + 1, r = 2 * idx + 2;
+        if (l < gen_queue.cnt && gen_queue_higher(l, top))
+            top = l;
+        if (r < gen_queue.cnt && gen_queue_higher(r, top))
+            top = r;
+        if (top == idx)
+            break;
+        gen_queue_swap(idx, top);
+        idx = top;
+    }
+}
+
+/* raise the priority of cert_name if queued. Returns 0 if not queued */
+static int gen_queue_bump_locked(const char *cert_name)
+{
+    name_node *n = name_tbl_find(&gen_queue.names, cert_name);
+
+    if (n == NULL)
+        return 0;
+    if (n->val >= 0) { /* not yet picked up by a worker */
+        gen_queue.heap[n->val].prio++;
+        gen_queue_sift_up(n->val);
+    }
+    return 1;
+}
+
+static void gen_queue_bump(const char *cert_name)
+{
+    if (gen_queue.heap == NULL)
+        return;
+    pthread_mutex_lock(&gen_queue.lock);
+    gen_queue_bump_locked(cert_name);
+    pthread_mutex_unlock(&gen_queue.lock);
+}
+
+static void gen_queue_push(const char *cert_name)
+{
+    gen_queue_struct *e;
+
+    if (gen_queue.heap == NULL || strlen(cert_name) > PIXELSERV_MAX_SERVER_NAME)
+        return;
+    pthread_mutex_lock(&gen_queue.lock);
+    if (gen_queue_bump_locked(cert_name))
+        ;
+    else if (gen_queue.cnt >= PIXEL_GEN_QUEUE_SIZE)
+        log_msg(LGG_WARNING, "%s: queue full. drop %s", __FUNCTION__, cert_name);
+    else if (name_tbl_add(&gen_queue.names, cert_name, gen_queue.cnt) == 0) {
+        e = &gen_queue.heap[gen_queue.cnt++];
+        strcpy(e->name, cert_name);
+        e->prio = 1;
+        e->seq = gen_queue.seq++;
+        get_time(&e->enq_time);
+        gen_queue_sift_up(gen_queue.cnt - 1);
+        pthread_cond_signal(&gen_queue.cond);
+    }
+    pthread_mutex_unlock(&gen_queue.lock);
+}
+
+/* take the name with the highest priority. It stays in gen_queue.names
+   until gen_queue_done(), so that it is not queued again meanwhile */
+static void gen_queue_pop(gen_queue_struct *job)
+{
+    pthread_mutex_lock(&gen_queue.lock);
+    while (gen_queue.cnt == 0)
+        pthread_cond_wait(&gen_queue.cond, &gen_queue.lock);
+    *job = gen_queue.heap[0];
+    name_tbl_find(&gen_queue.names, job->name)->val = -1;
+    if (--gen_queue.cnt > 0) {
+        gen_queue.heap[0] = gen_queue.heap[gen_queue.cnt];
+        name_tbl_find(&gen_queue.names, gen_queue.heap[0].name)->val = 0;
+        gen_queue_sift_down(0);
+    }
+    gen_queue.busy++;
+    pthread_mutex_unlock(&gen_queue.lock);
+}
+
+static void gen_queue_done(gen_queue_struct *job)
+{
+    /* latency as seen by clients: from queued to cert ready */
+    float latency = elapsed_time_msec(job->enq_time);
+
+    pthread_mutex_lock(&gen_queue.lock);
+    name_tbl_del(&gen_queue.names, job->name);
+    gen_queue.busy--;
+    gen_queue.lat_avg = ema(gen_queue.lat_avg, latency, &gen_queue.lat_cnt);
+    if (latency > gen_queue.lat_max)
+        gen_queue.lat_max = latency;
+    pthread_mutex_unlock(&gen_queue.lock);
+
+    /* wake handshakes waiting for a cert */
+    pthread_mutex_lock(&gen_lock);
+    pthread_cond_broadcast(&gen_cond);
+    pthread_mutex_unlock(&gen_lock);
+}
+
+/* run the calling generator thread below service threads: SCHED_IDLE or a
+   nice level. Per-thread on linux; elsewhere nice applies to the process
+   and is skipped */
+static void gen_thread_deprioritize()
+{
+    if (gen_budget.nice == 0)
+        return;
+#if defined(linux) && defined(SCHED_IDLE)
+    if (gen_budget.nice == PIXEL_GEN_NICE_IDLE) {
+        struct sched_param sp = { 0 };
+        if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp) != 0)
+            log_msg(LGG_WARNING, "%s: SCHED_IDLE not available", __FUNCTION__);
+        return;
+    }
+#endif
+#ifdef linux
+    if (setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+                    gen_budget.nice == PIXEL_GEN_NICE_IDLE ? 19 : gen_budget.nice) < 0)
+        log_msg(LGG_WARNING, "%s: setpriority failed: %m", __FUNCTION__);
+#endif
+}
+
+/* take a token before generating a cert. Tokens refill at the configured
+   rate, scaled down as service threads (kcc) get busy. Waits if none */
+static void gen_budget_take()
+{
+    struct timespec now, ts;
+    double rate, wait;
+    int deferred = 0;
+
+    if (gen_budget.rate == 0)
+        return;
+    pthread_mutex_lock(&gen_budget.lock);
+    for (;;) {
+        get_time(&now);
+        rate = (double)gen_budget.rate * PIXEL_GEN_KCC_REF / (PIXEL_GEN_KCC_REF + kcc);
+        if (rate < PIXEL_GEN_RATE_MIN)
+            rate = PIXEL_GEN_RATE_MIN;
+        gen_budget.tokens += rate * ((now.tv_sec - gen_budget.last.tv_sec)
+                                     + (now.tv_nsec - gen_budget.last.tv_nsec) / 1e9);
+        if (gen_budget.tokens > gen_budget.rate)
+            gen_budget.tokens = gen_budget.rate; /* burst of one second */
+        gen_budget.last = now;
+        if (gen_budget.tokens >= 1)
+            break;
+        if (!deferred++)
+            gen_budget.cnt_defer++;
+        wait = (1 - gen_budget.tokens) / rate;
+        gen_budget.msec_defer += wait * 1000;
+        pthread_mutex_unlock(&gen_budget.lock);
+        ts.tv_sec = wait;
+        ts.tv_nsec = (wait - ts.tv_sec) * 1e9;
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&gen_budget.lock);
+    }
+    gen_budget.tokens -= 1;
+    pthread_mutex_unlock(&gen_budget.lock);
+}
+
+void cert_gen_set_budget(int nice, int rate)
+{
+    gen_budget.nice = nice;
+    gen_budget.rate = rate;
+    gen_budget.tokens = rate;
+    get_time(&gen_budget.last);
+}
+
+static void *cert_worker(void *ptr)
+{
+    cert_tlstor_t *ct = (cert_tlstor_t *) ptr;
+    gen_queue_struct job;
+    char cert_file[PIXELSERV_MAX_PATH];
+
+    gen_thread_deprioritize();
+    for (;;) {
+        gen_queue_pop(&job);
+        gen_budget_take();
+        snprintf(cert_file, PIXELSERV_MAX_PATH, "%s/%s", ct->pem_dir, job.name);
+        /* names from the control socket may exist already */
+        if(!cert_exists(job.name, cert_file) && ct->privkey && ct->issuer)
+            generate_cert(job.name, ct->pem_dir, ct->issuer, ct->privkey);
+        /* let the next handshake find the new cert on disk */
+        neg_tbl_remove(job.name);
+        gen_queue_done(&job);
+    }
+    return NULL;
+}
+
+static void gen_workers_start(cert_tlstor_t *ct)
+{
+    int idx;
+    for (idx = 0; gen_queue.heap && idx < gen_queue.workers; idx++) {
+        pthread_t worker;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&worker, &attr, cert_worker, ct))
+            log_msg(LGG_ERR, "%s: failed to create worker %d", __FUNCTION__, idx);
+        pthread_attr_destroy(&attr);
+    }
+}
+
+static void *cert_stage_flusher(void *ptr)
+{
+    const char *pem_dir = ((cert_tlstor_t *) ptr)->pem_dir;
+
+    gen_thread_deprioritize();
+    for (;;) {
+        sleep(PIXEL_STAGE_POLL_SEC);
+        pthread_mutex_lock(&cert_stage.flush_lock);
+        while (cert_stage_flush(pem_dir, 0) == PIXEL_STAGE_BATCH);
+        pthread_mutex_unlock(&cert_stage.flush_lock);
+    }
+    return NULL;
+}
+
+static void cert_stage_start(cert_tlstor_t *ct)
+{
+    pthread_t flusher;
+    pthread_attr_t attr;
+
+    if (cert_stage.delay <= 0)
+        return;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&flusher, &attr, cert_stage_flusher, ct))
+        log_msg(LGG_ERR, "%s: failed to create flusher", __FUNCTION__);
+    pthread_attr_destroy(&attr);
+}
+
+void checkpoint_request()
+{
+    if (checkpoint.pipe[1] >= 0 && write(checkpoint.pipe[1], "c", 1) < 0)
+        ; /* a checkpoint is pending already */
+}
+
+static void *checkpointer(void *ptr)
+{
+    const char *pem_dir = ((cert_tlstor_t *) ptr)->pem_dir;
+    struct pollfd pfd = { checkpoint.pipe[0], POLLIN, 0 };
+    int warming;
+    char c;
+
+    for (;;) {
+        if (poll(&pfd, 1, PIXEL_CHECKPOINT_SEC * 1000) > 0)
+            while (read(checkpoint.pipe[0], &c, 1) > 0);
+        /* a partly warmed cache would cut the ranking short */
+        pthread_mutex_lock(&prefetch.lock);
+        warming = prefetch.threads;
+        pthread_mutex_unlock(&prefetch.lock);
+        if (!warming)
+            sslctx_tbl_checkpoint(pem_dir, 0);
+        usage_save(pem_dir);
+        sslctx_tbl_auto_size();
+    }
+    return NULL;
+}
+
+static void checkpoint_start(cert_tlstor_t *ct)
+{
+    pthread_t thread;
+    pthread_attr_t attr;
+
+    if (pipe(checkpoint.pipe) == 0) {
+        fcntl(checkpoint.pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(checkpoint.pipe[1], F_SETFL, O_NONBLOCK);
+        fcntl(checkpoint.pipe[0], F_SETFD, FD_CLOEXEC);
+        fcntl(checkpoint.pipe[1], F_SETFD, FD_CLOEXEC);
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, checkpointer, ct))
+        log_msg(LGG_ERR, "%s: failed to create checkpointer", __FUNCTION__);
+    pthread_attr_destroy(&attr);
+}
+
+void cert_gen_set_workers(int workers)
+{
+    gen_queue.workers = workers;
+    gen_queue.heap = malloc(PIXEL_GEN_QUEUE_SIZE * sizeof(gen_queue_struct));
+    if (gen_queue.heap == NULL || name_tbl_init(&gen_queue.names, PIXEL_GEN_QUEUE_SIZE) < 0) {
+        log_msg(LGG_ERR, "%s: failed to allocate queue", __FUNCTION__);
+        free(gen_queue.heap);
+        gen_queue.heap = NULL;
+    }
+}
+
+int cert_ctrl_open(const char *path)
+{
+    struct sockaddr_un addr;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        log_msg(LGG_ERR, "%s: path too long %s", __FUNCTION__, path);
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if ((cert_ctrl.fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0
+        || bind(cert_ctrl.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || chmod(path, 0600) < 0) {
+        log_msg(LGG_ERR, "%s: failed to open %s: %s", __FUNCTION__, path, strerror(errno));
+        if (cert_ctrl.fd >= 0)
+            close(cert_ctrl.fd);
+        cert_ctrl.fd = -1;
+        return -1;
+    }
+    fcntl(cert_ctrl.fd, F_SETFD, FD_CLOEXEC);
+    strcpy(cert_ctrl.path, path);
+    return 0;
+}
+
+void cert_ctrl_close()
+{
+    if (cert_ctrl.fd < 0)
+        return;
+    close(cert_ctrl.fd);
+    unlink(cert_ctrl.path);
+    cert_ctrl.fd = -1;
+}
+
+void *cert_generator(void *ptr) {
 #ifdef DEBUG
-        buf[rv] = '\0';
-        printf("%s: %d, %d\n", buf, size, rv);
+    printf("%s: thread up and running\n", __FUNCTION__);
+#endif
+    int idle = 0;
+
+    char buf[PIXELSERV_MAX_SERVER_NAME * 4 + 1];
+
+    srand((unsigned int)time(NULL));
+
+    /* misses are queued in-process by tls_clienthello_cb and certs are
+       generated by the workers. this thread reads names from the control
+       socket and does housekeeping */
+    gen_workers_start((cert_tlstor_t *) ptr);
+    cert_stage_start((cert_tlstor_t *) ptr);
+    checkpoint_start((cert_tlstor_t *) ptr);
+    gen_thread_deprioritize(); /* for key pool refills */
+    usage_gc(((cert_tlstor_t *) ptr)->pem_dir);
+
+    for (;;) {
+        int cnt, ret;
+        /* poll() ignores a negative fd */
+        struct pollfd pfd[3] = { { cert_ctrl.fd, POLLIN, 0 }, { cert_idx.ifd, POLLIN, 0 },
+                                 { allowlist.reload_pipe[0], POLLIN, 0 } };
+        int pool_low = key_pool_low();
+        ret = poll(pfd, 3, pool_low ? 0 : 1000 * PIXEL_SSL_SESS_TIMEOUT / 4);
+        if (ret > 0 && (pfd[2].revents & POLLIN)) {
+            char c;
+            while (read(allowlist.reload_pipe[0], &c, 1) > 0);
+            allowlist_load();
+            if (!pfd[0].revents && !pfd[1].revents)
+                continue;
+        }
+#ifdef linux
+        if (ret > 0 && (pfd[1].revents & POLLIN)) {
+            cert_idx_read_events();
+            if (!pfd[0].revents)
+                continue;
+        }
+#endif
+        if (ret == 0 && pool_low) {
+            /* nothing to do. top up the key pool, one key at a time */
+            key_pool_refill();
+            continue;
+        }
+        if (ret <= 0) {
+            /* timeout */
+            sslctx_tbl_check_and_flush();
+            usage_gc(((cert_tlstor_t *) ptr)->pem_dir);
+            if (kcc == 0) {
+                if (++idle >= (3600 / (PIXEL_SSL_SESS_TIMEOUT / 4))) {
+                    /* flush conn_stor after 3600 seconds */
+                    conn_stor_flush();
+                    idle = 0;
+                }
+#if defined(__GLIBC__) && !defined(__UCLIBC__)
+                malloc_trim(0);
 #endif
+            }
+            continue;
+        }
+        /* a datagram holds whole names, separated by ':' or whitespace */
+        if ((cnt = recv(cert_ctrl.fd, buf, sizeof(buf) - 1, MSG_DONTWAIT)) <= 0)
+            continue;
+        buf[cnt] = '\0';
+        char *p_buf, *p_buf_sav = NULL;
+        p_buf = strtok_r(buf, ": \t\r\n", &p_buf_sav);
+        while (p_buf != NULL) {
+            gen_queue_push(p_buf);
+            p_buf = strtok_r(NULL, ": \t\r\n", &p_buf_sav);
+        }
+        /* quick check and flush if time due */
+        sslctx_tbl_check_and_flush();
+    }
+    return NULL;
+}
+
+/* load a cert into sslctx_tbl ahead of its first handshake. The SSL_CTX is
+   created outside sslctx_lock to not hold up handshakes meanwhile. Unless
+   evict is set, only a free slot is used. Not counted as a cache miss.
+   Returns 1 if loaded, 0 if cached already, no room or not loadable */
+static int sslctx_tbl_warm(const char *cert_name, const char *cert_file, const STACK_OF(X509_INFO) *cachain, int evict)
+{
+    sslctx_cache_struct key, *found;
+    SSL_CTX *sslctx;
+    int full;
+
+    key.cert_name = (char *)cert_name;
+    pthread_mutex_lock(&sslctx_lock);
+    found = bsearch(&key, SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_certname);
+    full = (sslctx_tbl_end >= sslctx_tbl_size);
+    pthread_mutex_unlock(&sslctx_lock);
+    if (found || (full && !evict) || (sslctx = create_child_sslctx(cert_name, cert_file, cachain)) == NULL)
+        return 0;
+    pthread_mutex_lock(&sslctx_lock);
+    found = bsearch(&key, SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct), cmp_sslctx_certname);
+    if (found == NULL && (evict || sslctx_tbl_end < sslctx_tbl_size)
+        && sslctx_tbl_cache(cert_name, sslctx, sslctx_tbl_ins_idx()) == 0) {
+        sslctx_tbl_cnt_miss--; /* not a miss of a handshake */
+        sslctx = NULL;
+    }
+    pthread_mutex_unlock(&sslctx_lock);
+    SSL_CTX_free(sslctx);
+    return sslctx == NULL;
+}
+
+/* load the cert of srv_name into sslctx_tbl, or queue it for generation
+   if allowed. Returns 1 if loaded, 2 if queued, 0 otherwise */
+static int cert_warm_name(const char *pem_dir, const STACK_OF(X509_INFO) *cachain, char *srv_name, int evict)
+{
+    char cert_name[PIXELSERV_MAX_SERVER_NAME + 2], cert_file[PIXELSERV_MAX_PATH];
+    const char *bundle;
+    char *p;
+
+    for (p = srv_name; *p; p++)
+        *p = tolower((unsigned char)*p);
+    if (p > srv_name && p[-1] == '.')
+        p[-1] = '\0'; /* unbound: trailing dot */
+    if (strlen(srv_name) > PIXELSERV_MAX_SERVER_NAME || strchr(srv_name, '.') == NULL)
+        return 0;
+    cert_name_for(srv_name, cert_name, sizeof(cert_name));
+    if ((bundle = bundle_lookup(cert_name)) != NULL)
+        strcpy(cert_name, bundle);
+    snprintf(cert_file, PIXELSERV_MAX_PATH, "%s/%s", pem_dir, cert_name);
+    if (cert_exists(cert_name, cert_file))
+        return sslctx_tbl_warm(cert_name, cert_file, cachain, evict);
+    if (neg_tbl_peek(cert_name) != SSL_ERR && allowlist_match(srv_name)) {
+        gen_queue_push(cert_name);
+        return 2;
+    }
+    return 0;
+}
+
+/* a name answered with one of our addresses. Warm its cert or queue it.
+   Blocked names are looked up far more often than visited, so they only
+   fill free slots and never push out certs in use */
+static void dns_log_name(const cert_tlstor_t *ct, char *srv_name)
+{
+    switch (cert_warm_name(ct->pem_dir, ct->cachain, srv_name, 0)) {
+        case 1: dns_log.cnt_warm++; break;
+        case 2: dns_log.cnt_gen++; break;
+    }
+}
+
+static int cmp_cache_info_hits(const void *p1, const void *p2)
+{
+    return ((cache_info_struct *)p2)->hits - ((cache_info_struct *)p1)->hits;
+}
+
+static int cmp_cache_info_last(const void *p1, const void *p2)
+{
+    unsigned int l1 = ((cache_info_struct *)p1)->last_use, l2 = ((cache_info_struct *)p2)->last_use;
+    return (l1 == l2) ? 0 : (l1 < l2) ? 1 : -1;
+}
+
+static int cmp_cache_info_bytes(const void *p1, const void *p2)
+{
+    return ((cache_info_struct *)p2)->bytes - ((cache_info_struct *)p1)->bytes;
+}
+
+static int cmp_cache_info_name(const void *p1, const void *p2)
+{
+    return strcmp(((cache_info_struct *)p1)->name, ((cache_info_struct *)p2)->name);
+}
+
+/* list cached certs: name, hits, seconds since last use and estimated
+   bytes, sorted by sort and paginated */
+static char* cache_admin_list(const char *sort, int offset, int limit)
+{
+    int (*cmp)(const void *, const void *) = cmp_cache_info_hits;
+    cache_info_struct *info;
+    unsigned int now = process_uptime();
+    int cnt = 0, idx, len, size;
+    char *buf;
+
+    if (sort && !strcmp(sort, "last"))
+        cmp = cmp_cache_info_last;
+    else if (sort && !strcmp(sort, "bytes"))
+        cmp = cmp_cache_info_bytes;
+    else if (sort && !strcmp(sort, "name"))
+        cmp = cmp_cache_info_name;
+    else
+        sort = "hits";
+
+    /* DER sizes are worked out after unlocking, on up-ref'd SSL_CTXs */
+    pthread_mutex_lock(&sslctx_lock);
+    if ((info = malloc((sslctx_tbl_end + 1) * sizeof(cache_info_struct))) != NULL)
+        for (idx = 0; idx < sslctx_tbl_end; idx++) {
+            if ((info[cnt].name = strdup(SSLCTX_TBL_get(idx, cert_name))) == NULL)
+                continue;
+            info[cnt].hits = SSLCTX_TBL_get(idx, reuse_count);
+            info[cnt].last_use = SSLCTX_TBL_get(idx, last_use);
+            info[cnt].sslctx = SSLCTX_TBL_get(idx, sslctx);
+            SSL_CTX_up_ref(info[cnt].sslctx);
+            cnt++;
+        }
+    pthread_mutex_unlock(&sslctx_lock);
+    if (info == NULL)
+        return NULL;
+    for (idx = 0; idx < cnt; idx++) {
+        X509 *x509 = SSL_CTX_get0_certificate(info[idx].sslctx);
+        EVP_PKEY *key = SSL_CTX_get0_privatekey(info[idx].sslctx);
+        info[idx].bytes = PIXEL_SSLCTX_BASE_SIZE + strlen(info[idx].name) + 1
+            + (x509 ? i2d_X509(x509, NULL) : 0) + (key ? key_der_len(key) : 0);
+        SSL_CTX_free(info[idx].sslctx);
+        info[idx].sslctx = NULL;
     }
+    qsort(info, cnt, sizeof(cache_info_struct), cmp);
 
-quit_cb:
-    free(fname);
-    return --rv; // trim \n at the end
+    if (offset > cnt)
+        offset = cnt;
+    if (limit > cnt - offset)
+        limit = cnt - offset;
+    size = 256 + limit * (PIXELSERV_MAX_SERVER_NAME + 64);
+    if ((buf = malloc(size)) != NULL) {
+        len = snprintf(buf, size, "# cert cache: %d of %d entries from %d by %s\n# name\thits\tidle_sec\tbytes\n",
+                       limit, cnt, offset, sort);
+        for (idx = offset; idx < offset + limit; idx++)
+            len += snprintf(buf + len, size - len, "%s\t%d\t%u\t%d\n", info[idx].name,
+                            info[idx].hits, now - info[idx].last_use, info[idx].bytes);
+    }
+    for (idx = 0; idx < cnt; idx++)
+        free(info[idx].name);
+    free(info);
+    return buf;
 }
 
-void cert_tlstor_init(const char *pem_dir, cert_tlstor_t *ct)
+/* drop cached certs matching any of the comma separated fnmatch()
+   patterns from both cache tiers. Certs on disk are kept */
+static char* cache_admin_evict(char *patterns)
 {
-    FILE *fp;
-    char cert_file[PIXELSERV_MAX_PATH];
-    X509 *x509 = X509_new();
+    char *pat[PIXEL_ADMIN_NAMES_MAX], *sav = NULL, *buf = NULL, *p;
+    der_cache_struct *e, *next;
+    int npat = 0, skipped = 0, cnt = 0, cnt_der = 0, idx, i;
 
-    memset(ct, 0, sizeof(cert_tlstor_t));
-    snprintf(cert_file, PIXELSERV_MAX_PATH, "%s/ca.crt", pem_dir);
-    fp = fopen(cert_file, "r");
+    for (p = strtok_r(patterns, ",", &sav); p; p = strtok_r(NULL, ",", &sav))
+        if (npat < PIXEL_ADMIN_NAMES_MAX)
+            pat[npat++] = p;
+        else
+            skipped++;
 
-    if(!fp || !PEM_read_X509(fp, &x509, NULL, NULL))
-       log_msg(LGG_ERR, "%s: failed to load ca.crt", __FUNCTION__);
-    else {
-        char *cafile;
-        int fsz;
-        BIO *bioin;
-        EVP_PKEY *pubkey = X509_get_pubkey(x509);
+    pthread_mutex_lock(&sslctx_lock);
+    for (idx = 0; idx < sslctx_tbl_end; ) {
+        for (i = 0; i < npat && fnmatch(pat[i], SSLCTX_TBL_get(idx, cert_name), 0); i++);
+        if (i == npat) {
+            idx++;
+            continue;
+        }
+        sslctx_tbl_drop(idx);
+        cnt++;
+    }
+    for (e = der_tbl.head; e; e = next) {
+        next = e->next;
+        for (i = 0; i < npat && fnmatch(pat[i], e->cert_name, 0); i++);
+        if (i < npat) {
+            der_tbl_drop(e);
+            cnt_der++;
+        }
+    }
+    pthread_mutex_unlock(&sslctx_lock);
+    if (asprintf(&buf, "evicted %d from cert cache, %d from DER cert cache%s\n", cnt, cnt_der,
+                 skipped ? ". too many patterns: some ignored" : "") < 0)
+        buf = NULL;
+    log_msg(LGG_NOTICE, "%s: %d + %d certs evicted", __FUNCTION__, cnt, cnt_der);
+    return buf;
+}
 
-        if (fseek(fp, 0L, SEEK_END) < 0)
-            log_msg(LGG_ERR, "%s: failed to seek ca.crt", __FUNCTION__);
+static void *cache_admin_warmer(void *ptr)
+{
+    cache_warm_struct *job = ptr;
+    char *name, *sav = NULL;
+    int loaded = 0, queued = 0;
 
-        fsz = ftell(fp);
-        cafile = malloc(fsz);
-        fseek(fp, 0L, SEEK_SET);
-        fsz = fread(cafile, 1, fsz, fp);
+    for (name = strtok_r(job->names, ",", &sav); name; name = strtok_r(NULL, ",", &sav))
+        switch (cert_warm_name(job->pem_dir, job->cachain, name, 1)) {
+            case 1: loaded++; break;
+            case 2: queued++; break;
+        }
+    log_msg(LGG_NOTICE, "%s: %d certs loaded, %d queued for generation", __FUNCTION__, loaded, queued);
+    free(job->names);
+    free(job);
+    pthread_mutex_lock(&admin_warm.lock);
+    admin_warm.threads--;
+    pthread_mutex_unlock(&admin_warm.lock);
+    return NULL;
+}
 
-        bioin = BIO_new_mem_buf(cafile, fsz);
-        if (!bioin)
-            log_msg(LGG_ERR, "%s: failed to create BIO mem buffer", __FUNCTION__);
+/* load the comma separated domains into the cache in a background thread,
+   unless PIXEL_ADMIN_WARM_THREADS are busy already */
+static char* cache_admin_warm(const char *names, const char *pem_dir, const STACK_OF(X509_INFO) *cachain)
+{
+    cache_warm_struct *job;
+    pthread_t warmer;
+    pthread_attr_t attr;
+    char *buf = NULL;
+    const char *p;
+    int cnt = 1, busy;
 
-        ct->pem_dir = pem_dir;
-        ct->cachain = PEM_X509_INFO_read_bio(bioin, NULL, NULL, NULL);
-        ct->issuer = X509_NAME_dup(X509_get_subject_name(x509));
+    pthread_mutex_lock(&admin_warm.lock);
+    if ((busy = (admin_warm.threads >= PIXEL_ADMIN_WARM_THREADS)) == 0)
+        admin_warm.threads++;
+    pthread_mutex_unlock(&admin_warm.lock);
+    if (busy) {
+        if (asprintf(&buf, "busy warming %d lists. try again later\n", PIXEL_ADMIN_WARM_THREADS) < 0)
+            buf = NULL;
+        return buf;
+    }
+    if ((job = malloc(sizeof(cache_warm_struct))) == NULL || (job->names = strdup(names)) == NULL) {
+        free(job);
+        pthread_mutex_lock(&admin_warm.lock);
+        admin_warm.threads--;
+        pthread_mutex_unlock(&admin_warm.lock);
+        return NULL;
+    }
+    job->pem_dir = pem_dir;
+    job->cachain = cachain;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&warmer, &attr, cache_admin_warmer, job)) {
+        log_msg(LGG_ERR, "%s: failed to create warm-up thread", __FUNCTION__);
+        free(job->names);
+        free(job);
+        pthread_mutex_lock(&admin_warm.lock);
+        admin_warm.threads--;
+        pthread_mutex_unlock(&admin_warm.lock);
+        cnt = 0;
+    } else
+        for (p = names; (p = strchr(p, ',')) != NULL; p++, cnt++);
+    pthread_attr_destroy(&attr);
+    if (asprintf(&buf, "warming %d names in the background\n", cnt) < 0)
+        buf = NULL;
+    return buf;
+}
 
-        if (ct->cachain == NULL)
-            log_msg(LGG_ERR, "%s: failed to read CA chains", __FUNCTION__);
+/* per shard counters of the TLS session cache */
+static char* cache_admin_sessions()
+{
+    int size = 128 + PIXEL_SESS_SHARDS * 80, len, idx;
+    char *buf;
 
-        BIO_free(bioin);
-        EVP_PKEY_free(pubkey);
-        free(cafile);
-        fclose(fp);
+    if ((buf = malloc(size)) == NULL)
+        return NULL;
+    len = snprintf(buf, size, "# sess cache: %d shards of %d KB\n# shard\tsessions\tbytes\thits\tmisses\tevicted\texpired\n",
+                   PIXEL_SESS_SHARDS, PIXEL_SESS_CACHE_KB / PIXEL_SESS_SHARDS);
+    for (idx = 0; idx < PIXEL_SESS_SHARDS; idx++) {
+        sess_shard_struct *shard = &sess_shards[idx];
+        pthread_mutex_lock(&shard->lock);
+        len += snprintf(buf + len, size - len, "%d\t%d\t%d\t%d\t%d\t%d\t%d\n", idx, shard->cnt, shard->bytes,
+                        shard->cnt_hit, shard->cnt_miss, shard->cnt_evict, shard->cnt_expire);
+        pthread_mutex_unlock(&shard->lock);
     }
-    X509_free(x509);
+    return buf;
+}
 
-    snprintf(cert_file, PIXELSERV_MAX_PATH, "%s/ca.key", pem_dir);
-    fp = fopen(cert_file, "r");
-    RSA *rsa = NULL;
+/* admin requests on DEFAULT_CACHE_URL. query is the URL decoded query
+   string: "sort=hits|last|bytes|name&offset=N&limit=N" to list,
+   "warm=a.com,b.com" to load or "evict=*.a.com,b.com" to drop entries.
+   "sessions=1" lists the TLS session cache shards instead */
+char* cache_admin(char *query, const char *pem_dir, const STACK_OF(X509_INFO) *cachain)
+{
+    char *arg, *val, *sav = NULL, *sort = NULL;
+    int offset = 0, limit = PIXEL_ADMIN_LIST_LIMIT;
 
-    if(!fp || !PEM_read_RSAPrivateKey(fp, &rsa, pem_passwd_cb, (void*)pem_dir))
-        log_msg(LGG_ERR, "%s: failed to load ca.key", __FUNCTION__);
-    else {
-        ct->privkey = EVP_PKEY_new();
-        EVP_PKEY_assign_RSA(ct->privkey, rsa); /* rsa auto freed when key is freed */
-        fclose(fp);
+    for (arg = strtok_r(query, "&", &sav); arg; arg = strtok_r(NULL, "&", &sav)) {
+        if ((val = strchr(arg, '=')) == NULL)
+            continue;
+        *val++ = '\0';
+        if (!strcmp(arg, "warm"))
+            return cache_admin_warm(val, pem_dir, cachain);
+        if (!strcmp(arg, "evict"))
+            return cache_admin_evict(val);
+        if (!strcmp(arg, "sessions"))
+            return cache_admin_sessions();
+        if (!strcmp(arg, "sort"))
+            sort = val;
+        else if (!strcmp(arg, "offset") && atoi(val) >= 0)
+            offset = atoi(val);
+        else if (!strcmp(arg, "limit") && atoi(val) > 0)
+            limit = atoi(val);
     }
+    return cache_admin_list(sort, offset, limit);
 }
 
-void cert_tlstor_cleanup(cert_tlstor_t *c)
+static int dns_log_is_local(const char *addr)
 {
-    sk_X509_INFO_pop_free(c->cachain, X509_INFO_free);
-    X509_NAME_free(c->issuer);
-    EVP_PKEY_free(c->privkey);
+    int i;
+    for (i = 0; i < dns_log.addr_cnt; i++)
+        if (!strcmp(dns_log.addr[i], addr))
+            return 1;
+    return 0;
 }
 
-void *cert_generator(void *ptr) {
-#ifdef DEBUG
-    printf("%s: thread up and running\n", __FUNCTION__);
-#endif
-    int idle = 0;
-    cert_tlstor_t *ct = (cert_tlstor_t *) ptr;
+/* dnsmasq: "... config ads.a.com is 192.168.1.2", "reply", "cached" or a
+   hosts file in place of "config". unbound: "... redirect ads.a.com. ..." */
+static void dns_log_line(const cert_tlstor_t *ct, char *line)
+{
+    char *tok[PIXEL_DNS_LOG_TOKENS], *sav = NULL;
+    int n = 0, i;
 
-    char buf[PIXELSERV_MAX_SERVER_NAME * 4 + 1];
-    char *half_token = buf + PIXELSERV_MAX_SERVER_NAME * 4;
-    buf[PIXELSERV_MAX_SERVER_NAME * 4] = '\0';
+    for (tok[n] = strtok_r(line, " \t\r\n", &sav); tok[n] && n < PIXEL_DNS_LOG_TOKENS - 1;
+         tok[++n] = strtok_r(NULL, " \t\r\n", &sav));
+    for (i = 0; i < n; i++) {
+        if (i >= 2 && i + 1 < n && !strcmp(tok[i], "is") && dns_log_is_local(tok[i + 1])
+            && (!strcmp(tok[i - 2], "config") || !strcmp(tok[i - 2], "reply")
+                || !strcmp(tok[i - 2], "cached") || tok[i - 2][0] == '/')) {
+            dns_log_name(ct, tok[i - 1]);
+            return;
+        }
+        if (i + 1 < n && !strcmp(tok[i], "redirect")) {
+            dns_log_name(ct, tok[i + 1]);
+            return;
+        }
+    }
+}
 
-    /* non block required. otherwise blocked until other side opens */
-    int fd = open(PIXEL_CERT_PIPE, O_RDONLY | O_NONBLOCK);
-    srand((unsigned int)time(NULL));
+/* collect the addresses of this host. DNS answers with one of them point
+   to pixelserv */
+int dns_log_init(const char *file, const char *ip_addr)
+{
+    struct ifaddrs *ifa, *i;
+
+    strncpy(dns_log.file, file, PIXELSERV_MAX_PATH - 1);
+    if (strcmp(ip_addr, "0.0.0.0") && strcmp(ip_addr, "::"))
+        strncpy(dns_log.addr[dns_log.addr_cnt++], ip_addr, INET6_ADDRSTRLEN - 1);
+    if (getifaddrs(&ifa) < 0) {
+        log_msg(LGG_ERR, "%s: getifaddrs failed: %m", __FUNCTION__);
+        return dns_log.addr_cnt ? 0 : -1;
+    }
+    for (i = ifa; i && dns_log.addr_cnt < PIXEL_DNS_LOG_ADDRS; i = i->ifa_next) {
+        char *a = dns_log.addr[dns_log.addr_cnt];
+        if (i->ifa_addr == NULL || (i->ifa_flags & IFF_LOOPBACK)
+            || (i->ifa_addr->sa_family != AF_INET && i->ifa_addr->sa_family != AF_INET6))
+            continue;
+        if (getnameinfo(i->ifa_addr, (i->ifa_addr->sa_family == AF_INET) ? sizeof(struct sockaddr_in)
+                        : sizeof(struct sockaddr_in6), a, INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST) == 0
+            && !dns_log_is_local(a))
+            dns_log.addr_cnt++;
+    }
+    freeifaddrs(ifa);
+    return 0;
+}
 
+/* follow the resolver's log file like tail -F, surviving log rotation */
+void *dns_log_watcher(void *ptr)
+{
+    const cert_tlstor_t *ct = (const cert_tlstor_t *) ptr;
+    char buf[PIXEL_DNS_LOG_BUF_SIZE + 1], *line, *nl;
+    int fd = -1, len = 0, cnt, ifd = -1, wd = -1;
+    struct stat st, fst;
+
+#ifdef linux
+    ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
     for (;;) {
-        int cnt, ret;
-        if(fd == -1)
-            log_msg(LGG_ERR, "%s: failed to open %s: %s", PIXEL_CERT_PIPE, strerror(errno));
-        strcpy(buf, half_token);
-        struct pollfd pfd = { fd, POLLIN, POLLIN };
-        ret = poll(&pfd, 1, 1000 * PIXEL_SSL_SESS_TIMEOUT / 4);
-        if (ret <= 0) {
-            /* timeout */
-            sslctx_tbl_check_and_flush();
-            if (kcc == 0) {
-                if (++idle >= (3600 / (PIXEL_SSL_SESS_TIMEOUT / 4))) {
-                    /* flush conn_stor after 3600 seconds */
-                    conn_stor_flush();
-                    idle = 0;
-                }
-#if defined(__GLIBC__) && !defined(__UCLIBC__)
-                malloc_trim(0);
+        if (fd < 0) {
+            if ((fd = open(dns_log.file, O_RDONLY | O_CLOEXEC)) < 0) {
+                sleep(1);
+                continue;
+            }
+            /* only new queries matter on start; all of a rotated file */
+            if (dns_log.started == 0)
+                lseek(fd, 0, SEEK_END);
+            dns_log.started = 1;
+            len = 0;
+#ifdef linux
+            if (ifd >= 0) {
+                if (wd >= 0)
+                    inotify_rm_watch(ifd, wd);
+                wd = inotify_add_watch(ifd, dns_log.file, IN_MODIFY);
+            }
 #endif
+        }
+        while ((cnt = read(fd, buf + len, PIXEL_DNS_LOG_BUF_SIZE - len)) > 0) {
+            buf[len + cnt] = '\0';
+            for (line = buf; (nl = strchr(line, '\n')) != NULL; line = nl + 1) {
+                *nl = '\0';
+                dns_log_line(ct, line);
             }
-            continue;
+            len = buf + len + cnt - line;
+            if (len == PIXEL_DNS_LOG_BUF_SIZE)
+                len = 0; /* no line is that long. drop it */
+            memmove(buf, line, len);
         }
-        if((cnt = read(fd, buf + strlen(half_token), PIXELSERV_MAX_SERVER_NAME * 4 - strlen(half_token))) == 0) {
-#ifdef DEBUG
-             printf("%s: pipe EOF\n", __FUNCTION__);
+        /* at the end of file. wait for more */
+#ifdef linux
+        if (ifd >= 0 && wd >= 0) {
+            struct pollfd pfd = { ifd, POLLIN, 0 };
+            char ev[sizeof(struct inotify_event) + NAME_MAX + 1];
+            if (poll(&pfd, 1, 1000) > 0)
+                while (read(ifd, ev, sizeof(ev)) > 0);
+        } else
 #endif
-            close(fd);
-            fd = open(PIXEL_CERT_PIPE, O_RDONLY | O_NONBLOCK); /* non block required */
-            continue;
-        }
-        if (cnt < PIXELSERV_MAX_SERVER_NAME * 4 - strlen(half_token)) {
-            buf[cnt + strlen(half_token)] = '\0';
-            half_token = buf + PIXELSERV_MAX_SERVER_NAME * 4;
-        } else {
-            int i;
-            for (i=1; buf[PIXELSERV_MAX_SERVER_NAME * 4 - i]!=':' && i < strlen(buf); i++);
-            half_token = buf + PIXELSERV_MAX_SERVER_NAME * 4 - i + 1;
-            buf[PIXELSERV_MAX_SERVER_NAME * 4 - i + 1] = '\0';
+        {
+            struct timespec ts = { 0, PIXEL_DNS_LOG_POLL_MSEC * 1000000L };
+            nanosleep(&ts, NULL);
         }
-        if (ct->privkey == NULL || ct->issuer == NULL)
-            continue;
-        char *p_buf, *p_buf_sav = NULL;
-        p_buf = strtok_r(buf, ":", &p_buf_sav);
-        while (p_buf != NULL) {
-            char cert_file[PIXELSERV_MAX_PATH];
-            struct stat st;
-            snprintf(cert_file, PIXELSERV_MAX_PATH, "%s/%s", ((cert_tlstor_t*)ct)->pem_dir, p_buf);
-            if(stat(cert_file, &st) != 0) /* doesn't exist */
-                generate_cert(p_buf, ct->pem_dir, ct->issuer, ct->privkey);
-            p_buf = strtok_r(NULL, ":", &p_buf_sav);
+        /* rotated or truncated: start over */
+        if (stat(dns_log.file, &st) < 0 || fstat(fd, &fst) < 0
+            || st.st_ino != fst.st_ino || st.st_size < lseek(fd, 0, SEEK_CUR)) {
+            close(fd);
+            fd = -1;
         }
-        /* quick check and flush if time due */
-        sslctx_tbl_check_and_flush();
     }
     return NULL;
 }
@@ -672,6 +4091,7 @@ static int tls_servername_cb(SSL *ssl, int *ad, void *arg) {
     strncpy(full_pem_path, cbarg->tls_pem, PIXELSERV_MAX_PATH);
     full_pem_path[len++] = '/';
     full_pem_path[len] = '\0';
+    int dir_len = len;
 
     char *srv_name = NULL;
 #ifdef TLS1_3_VERSION
@@ -692,25 +4112,8 @@ static int tls_servername_cb(SSL *ssl, int *ad, void *arg) {
     printf("SNI servername: %s\n", srv_name);
 #endif
 
-    int dot_count = 0;
-    char *tld = NULL;
-    char *pem_file = strchr(srv_name, '.');
-    while(pem_file){
-        dot_count++;
-        tld = pem_file + 1;
-        pem_file = strchr(tld, '.');
-    }
-    if (dot_count <= 1 || (dot_count == 3 && atoi(tld) > 0)) {
-        pem_file = srv_name;
-        strncat(full_pem_path, srv_name, PIXELSERV_MAX_PATH - len);
-        len += strlen(srv_name);
-    } else {
-        pem_file = full_pem_path + strlen(full_pem_path);
-        strncat(full_pem_path, "_", PIXELSERV_MAX_PATH - len);
-        len += 1;
-        strncat(full_pem_path, strchr(srv_name, '.'), PIXELSERV_MAX_PATH - len);
-        len += strlen(strchr(srv_name, '.'));
-    }
+    char *pem_file = full_pem_path + dir_len;
+    len += cert_name_for(srv_name, pem_file, PIXELSERV_MAX_PATH + 1 - dir_len);
 #ifdef DEBUG
     printf("PEM filename: %s\n",full_pem_path);
 #endif
@@ -719,9 +4122,17 @@ static int tls_servername_cb(SSL *ssl, int *ad, void *arg) {
         rv = CB_ERR;
         goto quit_cb;
     }
+    /* names in a bundle share its cert and cache entry */
+    const char *bundle = bundle_lookup(pem_file);
+    if (bundle && dir_len + strlen(bundle) <= PIXELSERV_MAX_PATH) {
+        pem_file = full_pem_path + dir_len;
+        strcpy(pem_file, bundle);
+    }
 
     SSL_CTX *sslctx;
+    sslctx_cache_struct key, *found;
     int handle, ins_handle;
+    pthread_mutex_lock(&sslctx_lock);
     sslctx_tbl_lookup(pem_file, &handle, &ins_handle);
 #ifdef DEBUG
     printf("%s: handle %d ins_handle %d\n", __FUNCTION__, handle, ins_handle);
@@ -729,58 +4140,91 @@ static int tls_servername_cb(SSL *ssl, int *ad, void *arg) {
         sslctx_tbl_dump(handle, __FUNCTION__);
     if (ins_handle >=0) sslctx_tbl_dump(ins_handle, __FUNCTION__);
 #endif
-    if (handle < 0) {
-        struct stat st;
-        if (stat(full_pem_path, &st) != 0) {
-            int fd;
-            cbarg->status = SSL_MISS;
-            log_msg(LGG_WARNING, "%s %s missing", srv_name, pem_file);
-            if ((fd = open(PIXEL_CERT_PIPE, O_WRONLY)) < 0)
-                log_msg(LGG_ERR, "%s: failed to open pipe: %s", __FUNCTION__, strerror(errno));
-            else {
-                int i;
-                for(i=0; i< strlen(pem_file); i++)
-                    *(full_pem_path + i) = *(pem_file + i);
-                *(full_pem_path + i) = ':';
-                *(full_pem_path + i + 1) = '\0';
-
-                if (write(fd, full_pem_path, strlen(full_pem_path)) < 0)
-                    log_msg(LGG_ERR, "%s: failed to write pipe: %s", __FUNCTION__, strerror(errno));
-                close(fd);
-            }
-            rv = CB_ERR;
-            goto quit_cb;
-        }
-        if (NULL == (sslctx  = create_child_sslctx(full_pem_path, cbarg->cachain))
-            || 0 > sslctx_tbl_cache(pem_file, sslctx, ins_handle)) {
-            log_msg(LGG_ERR, "%s: fail to create sslctx or cache %s", __FUNCTION__, pem_file);
-            cbarg->status = SSL_ERR;
-            rv = CB_ERR;
-            goto quit_cb;
-        }
-    } else
-        sslctx = SSLCTX_TBL_get(handle, sslctx);
+    if (handle >= 0) {
+        SSL_set_SSL_CTX(ssl, SSLCTX_TBL_get(handle, sslctx));
+        pthread_mutex_unlock(&sslctx_lock);
+        goto quit_hit;
+    }
+    pthread_mutex_unlock(&sslctx_lock);
 
+    /* load the cert without sslctx_lock so that slow storage holds up no
+       other handshake, then cache it unless a racing handshake did */
+    /* no certs for names outside the allowlist: typos, scanners */
+    if (!allowlist_match(srv_name)) {
+        log_msg(LGG_INFO, "%s not in allowlist", srv_name);
+        cbarg->status = SSL_DENY;
+        rv = CB_ERR;
+        goto quit_cb;
+    }
+    /* fail fast on certs known to be pending generation or not usable */
+    if ((cbarg->status = neg_tbl_lookup(pem_file)) != SSL_UNKNOWN) {
+        log_msg(LGG_DEBUG, "%s %s in negative cache", srv_name, pem_file);
+        if (cbarg->status == SSL_MISS)
+            gen_queue_bump(pem_file); /* missed again. generate sooner */
+        rv = CB_ERR;
+        goto quit_cb;
+    }
+    if (!cert_exists(pem_file, full_pem_path)) {
+        int suspend = 0;
+#ifdef TLS1_3_VERSION
+        /* first miss of this handshake: suspend it until the cert is
+           generated. the service thread resumes it by cert_gen_wait() */
+        suspend = (cert_gen_deadline > 0 && !cbarg->gen_wait);
+#endif
+        cbarg->status = SSL_MISS;
+        if (suspend) {
+            cbarg->gen_wait = 1;
+            strncpy(cbarg->gen_cert, pem_file, sizeof(cbarg->gen_cert) - 1);
+            cbarg->gen_cert[sizeof(cbarg->gen_cert) - 1] = '\0';
+        } else
+            neg_tbl_insert(pem_file, SSL_MISS);
+        log_msg(LGG_WARNING, "%s %s missing", srv_name, pem_file);
+        /* coalesced with a pending request of the same name */
+        gen_queue_push(pem_file);
+#ifdef TLS1_3_VERSION
+        rv = suspend ? SSL_CLIENT_HELLO_RETRY : CB_ERR;
+#else
+        rv = CB_ERR;
+#endif
+        goto quit_cb;
+    }
+    if (NULL == (sslctx = create_child_sslctx(pem_file, full_pem_path, cbarg->cachain))
+        && cert_drop_keyless(pem_file, full_pem_path)) {
+        cbarg->status = SSL_MISS;
+        neg_tbl_insert(pem_file, SSL_MISS);
+        gen_queue_push(pem_file);
+        rv = CB_ERR;
+        goto quit_cb;
+    }
+    key.cert_name = pem_file;
+    pthread_mutex_lock(&sslctx_lock);
+    if (sslctx && (found = bsearch(&key, SSLCTX_TBL_ptr(0), sslctx_tbl_end, sizeof(sslctx_cache_struct),
+                                   cmp_sslctx_certname)) != NULL) {
+        SSL_set_SSL_CTX(ssl, found->sslctx);
+        pthread_mutex_unlock(&sslctx_lock);
+        SSL_CTX_free(sslctx);
+        goto quit_hit;
+    }
+    if (NULL == sslctx || 0 > sslctx_tbl_cache(pem_file, sslctx, sslctx_tbl_ins_idx())) {
+        pthread_mutex_unlock(&sslctx_lock);
+        SSL_CTX_free(sslctx);
+        log_msg(LGG_ERR, "%s: fail to create sslctx or cache %s", __FUNCTION__, pem_file);
+        cbarg->status = SSL_ERR;
+        neg_tbl_insert(pem_file, SSL_ERR);
+        rv = CB_ERR;
+        goto quit_cb;
+    }
     SSL_set_SSL_CTX(ssl, sslctx);
+    pthread_mutex_unlock(&sslctx_lock);
+
+quit_hit:
     cbarg->status = SSL_HIT;
+    usage_touch(pem_file, 1);
 quit_cb:
     return rv;
 }
 
-/*
-static int new_session(SSL *ssl, SSL_SESSION *sess) {
-    return 1; // keep internal session
-}
-
-static void remove_session(SSL_CTX *sslctx, SSL_SESSION *sess) {
-}
-
-static SSL_SESSION *get_session(SSL *ssl, unsigned char *id, int idlen, int *do_copy) {
-    return NULL;
-}
-*/
-
-static SSL_CTX* create_child_sslctx(const char* full_pem_path, const STACK_OF(X509_INFO) *cachain)
+static SSL_CTX* create_child_sslctx(const char* cert_name, const char* full_pem_path, const STACK_OF(X509_INFO) *cachain)
 {
     SSL_CTX *sslctx = SSL_CTX_new(SSLv23_server_method());
 #ifdef PIXELSERV_SSL_HAS_ECDH_AUTO
@@ -795,9 +4239,10 @@ static SSL_CTX* create_child_sslctx(const char* full_pem_path, const STACK_OF(X5
     SSL_CTX_set_options(sslctx,
           SSL_OP_SINGLE_DH_USE |
           SSL_MODE_RELEASE_BUFFERS |
-          SSL_OP_NO_COMPRESSION | SSL_OP_NO_TICKET |
+          SSL_OP_NO_COMPRESSION |
           SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1_1 |
           SSL_OP_CIPHER_SERVER_PREFERENCE);
+    tls_tickets_setup(sslctx);
     /* server-side caching */
     SSL_CTX_set_session_cache_mode(sslctx, SSL_SESS_CACHE_NO_AUTO_CLEAR | SSL_SESS_CACHE_SERVER);
     SSL_CTX_set_timeout(sslctx, PIXEL_SSL_SESS_TIMEOUT);
@@ -811,12 +4256,31 @@ static SSL_CTX* create_child_sslctx(const char* full_pem_path, const STACK_OF(X5
     if (SSL_CTX_set_ciphersuites(sslctx, PIXELSERV_TLSV1_3_CIPHERS) <= 0)
         log_msg(LGG_DEBUG, "%s: failed to set TLSv1.3 ciphersuites", __FUNCTION__);
 #endif
-    if(SSL_CTX_use_certificate_file(sslctx, full_pem_path, SSL_FILETYPE_PEM) <= 0
-       || SSL_CTX_use_PrivateKey_file(sslctx, full_pem_path, SSL_FILETYPE_PEM) <= 0)
-    {
-        SSL_CTX_free(sslctx);
-        log_msg(LGG_ERR, "%s: cannot find or use %s\n", __FUNCTION__, full_pem_path);
-        return NULL;
+    X509 *x509;
+    EVP_PKEY *key;
+    if (der_tbl_get(cert_name, &x509, &key) == 0 || cert_stage_get(cert_name, &x509, &key) == 0
+        || cert_store_get(cert_name, &x509, &key) == 0) {
+        int ok = (SSL_CTX_use_certificate(sslctx, x509) > 0 && SSL_CTX_use_PrivateKey(sslctx, key) > 0);
+        X509_free(x509);
+        EVP_PKEY_free(key);
+        if (!ok) {
+            SSL_CTX_free(sslctx);
+            log_msg(LGG_ERR, "%s: cannot use %s from memory\n", __FUNCTION__, cert_name);
+            return NULL;
+        }
+    } else {
+        int ok = (SSL_CTX_use_certificate_file(sslctx, full_pem_path, SSL_FILETYPE_PEM) > 0);
+        /* PEM files of certs with the shared key hold the cert only */
+        if (ok && (key = shared_key_for(SSL_CTX_get0_certificate(sslctx))) != NULL)
+            ok = (SSL_CTX_use_PrivateKey(sslctx, key) > 0);
+        else if (ok)
+            ok = (SSL_CTX_use_PrivateKey_file(sslctx, full_pem_path, SSL_FILETYPE_PEM) > 0);
+        EVP_PKEY_free(key);
+        if (!ok) {
+            SSL_CTX_free(sslctx);
+            log_msg(LGG_ERR, "%s: cannot find or use %s\n", __FUNCTION__, full_pem_path);
+            return NULL;
+        }
     }
     if (cachain) {
         X509_INFO *inf; int i;
@@ -835,6 +4299,8 @@ static SSL_CTX* create_child_sslctx(const char* full_pem_path, const STACK_OF(X5
 
 SSL_CTX* create_default_sslctx(const char *pem_dir)
 {
+    int idx;
+
     if (g_sslctx)
         return g_sslctx;
 
@@ -844,19 +4310,25 @@ SSL_CTX* create_default_sslctx(const char *pem_dir)
           SSL_OP_NO_COMPRESSION |
           SSL_OP_NO_SSLv2 | SSL_OP_NO_SSLv3 | SSL_OP_NO_TLSv1_1 |
           SSL_OP_CIPHER_SERVER_PREFERENCE);
-    SSL_CTX_sess_set_cache_size(g_sslctx, PIXEL_SSL_SESS_CACHE_SIZE);
-    SSL_CTX_set_session_cache_mode(g_sslctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_cache_mode(g_sslctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
     SSL_CTX_set_timeout(g_sslctx, PIXEL_SSL_SESS_TIMEOUT);
-/*    // cb for server-side caching
+    /* cb for server-side caching */
+    for (idx = 0; idx < PIXEL_SESS_SHARDS; idx++)
+        pthread_mutex_init(&sess_shards[idx].lock, NULL);
     SSL_CTX_sess_set_new_cb(g_sslctx, new_session);
-    SSL_CTX_sess_set_remove_cb(g_sslctx, remove_session); */
+    SSL_CTX_sess_set_remove_cb(g_sslctx, remove_session);
+    SSL_CTX_sess_set_get_cb(g_sslctx, get_session);
     if (SSL_CTX_set_cipher_list(g_sslctx, PIXELSERV_CIPHER_LIST) <= 0)
         log_msg(LGG_DEBUG, "cipher_list cannot be set");
 #ifndef TLS1_3_VERSION
     SSL_CTX_set_tlsext_servername_callback(g_sslctx, tls_servername_cb);
 #else
     SSL_CTX_set_max_early_data(g_sslctx, PIXEL_TLS_EARLYDATA_SIZE);
+    SSL_CTX_set_options(g_sslctx, SSL_OP_NO_ANTI_REPLAY);
+    SSL_CTX_set_allow_early_data_cb(g_sslctx, tls_early_data_cb, NULL);
 #endif
+    tls_ticket_keys_rotate();
+    tls_tickets_setup(g_sslctx);
     return g_sslctx;
 }
 
@@ -950,7 +4422,113 @@ err_quit:
     free(buf);
     return NULL;
 }
+
+/* block until the cert of a suspended handshake is generated or the
+   deadline passes */
+static void cert_gen_wait(const tlsext_cb_arg_struct *cbarg)
+{
+    char full_pem_path[PIXELSERV_MAX_PATH];
+    struct timespec ts;
+    int rv = 0;
+
+    snprintf(full_pem_path, PIXELSERV_MAX_PATH, "%s/%s", cbarg->tls_pem, cbarg->gen_cert);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += cert_gen_deadline / 1000;
+    ts.tv_nsec += (cert_gen_deadline % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    pthread_mutex_lock(&gen_lock);
+    while (rv != ETIMEDOUT && !cert_exists(cbarg->gen_cert, full_pem_path))
+        rv = pthread_cond_timedwait(&gen_cond, &gen_lock, &ts);
+    pthread_mutex_unlock(&gen_lock);
+    if (rv == ETIMEDOUT)
+        log_msg(LGG_WARNING, "%s: %s not ready in %d ms", __FUNCTION__, cbarg->gen_cert, cert_gen_deadline);
+}
+
+/* resume a handshake suspended by tls_clienthello_cb. Same steps as the
+   main thread: early data first, then the rest of the handshake */
+int tls_resume_handshake(conn_tlstor_struct *c)
+{
+    int sslerr;
+
+    cert_gen_wait(c->tlsext_cb_arg);
+    c->early_data = read_tls_early_data(c->ssl, &sslerr);
+    if (c->early_data)
+        return 0;
+    if (sslerr != SSL_ERROR_NONE)
+        return -1;
+    ERR_clear_error();
+    return (SSL_accept(c->ssl) == 1) ? 0 : -1;
+}
+#endif
+
+/* full TLS handshake with sslctx over a memory BIO pair. Measures the cost
+   of both ends; mostly key exchange and signing with the leaf key */
+static float bench_handshake(SSL_CTX *sslctx, int rounds)
+{
+    SSL_CTX *cctx = SSL_CTX_new(SSLv23_client_method());
+    struct timespec tm;
+    int r, n, ok = 1;
+
+    if (cctx == NULL || sslctx == NULL)
+        return -1;
+    get_time(&tm);
+    for (r = 0; r < rounds && ok; r++) {
+        SSL *srv = SSL_new(sslctx), *cli = SSL_new(cctx);
+        BIO *sbio, *cbio;
+        int s_rv = 0, c_rv = 0;
+
+        BIO_new_bio_pair(&sbio, 0, &cbio, 0);
+        SSL_set_bio(srv, sbio, sbio);
+        SSL_set_bio(cli, cbio, cbio);
+        SSL_set_accept_state(srv);
+        SSL_set_connect_state(cli);
+        for (n = 0; n < 20 && (s_rv != 1 || c_rv != 1); n++) {
+            if (c_rv != 1)
+                c_rv = SSL_do_handshake(cli);
+            if (s_rv != 1)
+                s_rv = SSL_do_handshake(srv);
+        }
+        ok = (s_rv == 1 && c_rv == 1);
+        SSL_free(cli);
+        SSL_free(srv);
+    }
+    SSL_CTX_free(cctx);
+    return ok ? elapsed_time_msec(tm) / rounds : -1;
+}
+
+static long heap_in_use()
+{
+#if defined(__GLIBC__) && !defined(__UCLIBC__)
+# if __GLIBC__ > 2 || __GLIBC_MINOR__ >= 33
+    return mallinfo2().uordblks;
+# else
+    return mallinfo().uordblks;
+# endif
+#else
+    return -1;
 #endif
+}
+
+/* heap used per cached SSL_CTX of cert. -1 if unknown */
+static long bench_cert_mem(const char *cert, const char *cert_file, const STACK_OF(X509_INFO) *cachain)
+{
+#define BENCH_MEM_CTX 20
+    SSL_CTX *sslctx[BENCH_MEM_CTX];
+    long mem0 = heap_in_use(), mem1;
+    int idx;
+
+    if (mem0 < 0)
+        return -1;
+    for (idx = 0; idx < BENCH_MEM_CTX; idx++)
+        sslctx[idx] = create_child_sslctx(cert, cert_file, cachain);
+    mem1 = heap_in_use();
+    for (idx = 0; idx < BENCH_MEM_CTX; idx++)
+        SSL_CTX_free(sslctx[idx]);
+    return (mem1 - mem0) / BENCH_MEM_CTX;
+}
 
 void run_benchmark(const cert_tlstor_t *ct, const char *cert)
 {
@@ -958,8 +4536,14 @@ void run_benchmark(const cert_tlstor_t *ct, const char *cert)
     char *cert_file = NULL, *domain;
     struct stat st;
     struct timespec tm;
-    float r_tm0, g_tm0, tm1;
+    float r_tm0, g_tm0, h_tm0, tm1;
     SSL_CTX *sslctx = NULL;
+    leaf_key_enum type, saved_type = leaf_key_type;
+    long der_max_bytes = der_tbl.max_bytes;
+    int pool_cnt = key_pool.cnt;
+    EVP_PKEY *saved_shared_key = shared_key;
+    long mem0, mem1;
+    int h_fail;
 
     printf("CERT_PATH: %s\n", ct->pem_dir);
     if (ct->cachain == NULL)
@@ -981,30 +4565,211 @@ void run_benchmark(const cert_tlstor_t *ct, const char *cert)
     if (asprintf(&domain, "%s", cert) > 0 && domain[0] == '_') 
       domain[0] = '*';
 
-    r_tm0 = 0; g_tm0 = 0;
-    for (c=1; c<=10; c++) {
-        get_time(&tm);
-        for (d=0; d<5; d++)
-            generate_cert(domain, ct->pem_dir, ct->issuer, ct->privkey);
-        tm1 = elapsed_time_msec(tm) / 5.0;
-        printf("%2d. generate cert to disk: %.3f ms\t", c, tm1);
-        g_tm0 += tm1;
+    der_tbl.max_bytes = 0; /* always load from disk */
+    key_pool.cnt = 0; /* always generate keys */
+    shared_key = NULL;
+    for (type = LEAF_KEY_RSA; type <= LEAF_KEY_EC; type++) {
+        leaf_key_type = type;
+        printf("KEY_TYPE: %s\n", leaf_key_name[type]);
+        r_tm0 = 0; g_tm0 = 0; h_tm0 = 0; h_fail = 0;
+        for (c=1; c<=10; c++) {
+            get_time(&tm);
+            for (d=0; d<5; d++)
+                generate_cert(domain, ct->pem_dir, ct->issuer, ct->privkey);
+            tm1 = elapsed_time_msec(tm) / 5.0;
+            printf("%2d. generate cert to disk: %.3f ms\t", c, tm1);
+            g_tm0 += tm1;
 
-        get_time(&tm);
-        for (d=0; d<5; d++) {
-            stat(cert_file, &st);
-            sslctx = create_child_sslctx(cert_file, ct->cachain);
-            sslctx_tbl_cache(cert, sslctx, 0);
+            get_time(&tm);
+            for (d=0; d<5; d++) {
+                stat(cert_file, &st);
+                sslctx = create_child_sslctx(cert, cert_file, ct->cachain);
+                sslctx_tbl_cache(cert, sslctx, 0);
+            }
+            tm1 = elapsed_time_msec(tm) / 5.0;
+            printf("load from disk: %.3f ms\t", tm1);
+            r_tm0 += tm1;
+
+            if ((tm1 = bench_handshake(sslctx, 5)) < 0) {
+                printf("handshake: failed\n");
+                h_fail = 1;
+            } else {
+                printf("handshake: %.3f ms\n", tm1);
+                h_tm0 += tm1;
+            }
         }
-        tm1 = elapsed_time_msec(tm) / 5.0;
-        printf("load from disk: %.3f ms\n", tm1);
-        r_tm0 += tm1;
+        printf("generate to disk average: %.3f ms\n", g_tm0 / 10.0);
+        printf("  load from disk average: %.3f ms\n", r_tm0 / 10.0);
+        if (!h_fail)
+            printf("       handshake average: %.3f ms\n", h_tm0 / 10.0);
+        else
+            printf("       handshake average: failed\n");
 
+        /* the same with one leaf key shared by all certs */
+        mem0 = bench_cert_mem(cert, cert_file, ct->cachain);
+        shared_key = generate_key(type);
+        get_time(&tm);
+        for (d=0; d<50; d++)
+            generate_cert(domain, ct->pem_dir, ct->issuer, ct->privkey);
+        tm1 = elapsed_time_msec(tm) / 50.0;
+        printf("generate with shared key: %.3f ms (saves %.3f ms)\n", tm1, g_tm0 / 10.0 - tm1);
+        mem1 = bench_cert_mem(cert, cert_file, ct->cachain);
+        if (mem0 >= 0)
+            printf("  memory per cached cert: %ld bytes, with shared key: %ld bytes (saves %ld bytes)\n",
+                mem0, mem1, mem0 - mem1);
+        EVP_PKEY_free(shared_key);
+        shared_key = NULL;
     }
-    printf("generate to disk average: %.3f ms\n", g_tm0 / 10.0);
-    printf("  load from disk average: %.3f ms\n", r_tm0 / 10.0);
+    leaf_key_type = saved_type;
+    der_tbl.max_bytes = der_max_bytes;
+    key_pool.cnt = pool_cnt;
+    shared_key = saved_shared_key;
 
     free(domain);
 quit:
     free(cert_file);
 }
+
+/* append the cert names for the domains on one line of a blocklist to
+   names/order. Returns # of names added */
+static int pregen_parse_line(char *line, name_tbl *names, char ***order, int *cnt, int *size)
+{
+    char *doms[PIXEL_BLOCKLIST_LINE_DOMAINS];
+    int n, i, added = 0;
+
+    n = blocklist_parse_line(line, doms);
+    for (i = 0; i < n; i++) {
+        char *d = doms[i], cert_name[PIXELSERV_MAX_SERVER_NAME + 2];
+        const char *bundle;
+        if (!strncmp(d, "*.", 2))
+            snprintf(cert_name, sizeof(cert_name), "_%s", d + 1);
+        else
+            cert_name_for(d, cert_name, sizeof(cert_name));
+        if ((bundle = bundle_lookup(cert_name)) != NULL)
+            strcpy(cert_name, bundle);
+        if (name_tbl_find(names, cert_name))
+            continue;
+        if (*cnt == *size) {
+            char **o = realloc(*order, (*size ? *size * 2 : 1024) * sizeof(char *));
+            if (o == NULL)
+                return added;
+            *order = o;
+            *size = *size ? *size * 2 : 1024;
+        }
+        if (name_tbl_add(names, cert_name, *cnt) < 0)
+            return added;
+        (*order)[(*cnt)++] = name_tbl_find(names, cert_name)->name;
+        added++;
+    }
+    return added;
+}
+
+/* generate certs for all domains in the blocklists with the cert workers.
+   Certs in CERT_PATH already are skipped, so an interrupted run resumes.
+   Names are ranked by order in the lists: first list, first line first */
+int cert_pregen(cert_tlstor_t *ct, char **files, int file_cnt)
+{
+    name_tbl names, seen = { NULL, 0, 0 };
+    prefetch_struct *list = NULL;
+    char **order = NULL, *line = NULL, fname[PIXELSERV_MAX_PATH];
+    size_t line_len = 0;
+    int cnt = 0, size = 0, idx, queued = 0, existed = 0, list_cnt = 0, list_size = 0;
+    struct timespec tm;
+    double msec;
+    FILE *fp;
+
+    if (ct->privkey == NULL || ct->issuer == NULL || gen_queue.heap == NULL) {
+        printf("CA cert or key not loaded from %s\n", ct->pem_dir);
+        return -1;
+    }
+    if (name_tbl_init(&names, 4096) < 0)
+        return -1;
+    for (idx = 0; idx < file_cnt; idx++) {
+        int added = 0;
+        if ((fp = fopen(files[idx], "r")) == NULL) {
+            printf("failed to open %s: %s\n", files[idx], strerror(errno));
+            continue;
+        }
+        while (getline(&line, &line_len, fp) != -1)
+            added += pregen_parse_line(line, &names, &order, &cnt, &size);
+        fclose(fp);
+        printf("%s: %d new names\n", files[idx], added);
+    }
+
+    gen_workers_start(ct);
+    get_time(&tm);
+    for (idx = 0; idx < cnt; idx++) {
+        snprintf(fname, PIXELSERV_MAX_PATH, "%s/%s", ct->pem_dir, order[idx]);
+        if (cert_exists(order[idx], fname)) {
+            existed++;
+            continue;
+        }
+        /* keep the queue full but never drop a name */
+        pthread_mutex_lock(&gen_lock);
+        while (gen_queue_get_cnt() >= PIXEL_GEN_QUEUE_SIZE)
+            pthread_cond_wait(&gen_cond, &gen_lock);
+        pthread_mutex_unlock(&gen_lock);
+        gen_queue_push(order[idx]);
+        if (++queued % 1000 == 0)
+            printf("%d of %d certs queued\n", queued, cnt - existed);
+    }
+    pthread_mutex_lock(&gen_lock);
+    while (gen_queue_get_cnt() > 0)
+        pthread_cond_wait(&gen_cond, &gen_lock);
+    pthread_mutex_unlock(&gen_lock);
+    msec = elapsed_time_msec(tm);
+    printf("%d certs generated in %.1f s with %d workers: %.1f certs/s. %d existed already\n",
+           queued, msec / 1000, gen_queue.workers, queued ? queued * 1000 / msec : 0, existed);
+
+    /* names in the current prefetch were seen in use: keep them on top */
+    snprintf(fname, PIXELSERV_MAX_PATH, "%s/prefetch", ct->pem_dir);
+    if (name_tbl_init(&seen, 1024) < 0
+        || (list = malloc((cnt + 1) * sizeof(prefetch_struct))) == NULL) {
+        printf("failed to allocate memory\n");
+        goto quit_pregen;
+    }
+    list_size = cnt + 1;
+    if ((fp = fopen(fname, "r")) != NULL) {
+        while (getline(&line, &line_len, fp) != -1) {
+            char *name = strtok(line, " \t\n"), *reuse = strtok(NULL, " \t\n"), *last = strtok(NULL, " \t\n");
+            prefetch_struct *p;
+            if (name == NULL || name_tbl_find(&seen, name) || name_tbl_add(&seen, name, 0) < 0)
+                continue;
+            if (list_cnt == list_size) {
+                if ((p = realloc(list, list_size * 2 * sizeof(prefetch_struct))) == NULL)
+                    break;
+                list = p;
+                list_size *= 2;
+            }
+            p = &list[list_cnt++];
+            p->name = name_tbl_find(&seen, name)->name;
+            p->reuse_count = reuse ? atoi(reuse) : 0;
+            p->last_use = last ? atol(last) : 0;
+        }
+        fclose(fp);
+    }
+    for (idx = 0; idx < cnt; idx++)
+        if (!name_tbl_find(&seen, order[idx])) {
+            prefetch_struct *p;
+            if (list_cnt == list_size) {
+                if ((p = realloc(list, list_size * 2 * sizeof(prefetch_struct))) == NULL)
+                    break;
+                list = p;
+                list_size *= 2;
+            }
+            p = &list[list_cnt++];
+            p->name = order[idx];
+            p->reuse_count = 0;
+            p->last_use = 0;
+        }
+    if (prefetch_write(ct->pem_dir, list, list_cnt) == 0)
+        printf("%s: %d names ranked\n", fname, list_cnt);
+
+quit_pregen:
+    name_tbl_free(&seen);
+    free(list);
+    free(line);
+    free(order);
+    name_tbl_free(&names);
+    return queued;
+}
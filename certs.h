@@ -5,15 +5,53 @@
 #include <openssl/pem.h>
 #include <openssl/ssl.h>
 
-#define PIXEL_SSL_SESS_CACHE_SIZE 128*20
+#define PIXEL_SESS_CACHE_KB 2048 /* memory for cached TLS sessions, all shards */
+#define PIXEL_SESS_SHARDS 16     /* a lock each, picked by session ID */
+#define PIXEL_SESS_BUCKETS 256   /* hash buckets per shard */
+#define PIXEL_SESS_BASE_SIZE 768 /* est. bytes of a decoded SSL_SESSION besides its DER */
+#define PIXEL_SESS_EXPIRE_STEP 4 /* expired sessions dropped per cache access and shard */
 #define PIXEL_SSL_SESS_TIMEOUT 3600 /* seconds */
-#define PIXEL_CERT_PIPE "/tmp/pixelcerts"
+#define PIXEL_CERT_STORE "certs.db"
+#define PIXEL_KEY_POOL_FILE "keypool"
+#define PIXEL_SHARED_KEY_FILE "leaf.key"
+#define PIXEL_BUNDLE_FILE "bundles"
+#define PIXEL_USAGE_FILE "usage"
+#define PIXEL_ARCHIVE_DIR "archive"
+#define PIXEL_BUNDLE_MAX 64
+#define PIXEL_BUNDLE_NAME_MAX 32
+#define PIXEL_BUNDLE_LINE_MAX 4096
+#define PIXEL_BLOCKLIST_LINE_DOMAINS 64
+#define PIXEL_DNS_LOG_ADDRS 16
+#define PIXEL_DNS_LOG_TOKENS 16
+#define PIXEL_DNS_LOG_BUF_SIZE 4096
+#define PIXEL_DNS_LOG_POLL_MSEC 100
+#define PIXEL_STAGE_BATCH 64
+#define PIXEL_STAGE_POLL_SEC 1
+#define PIXEL_CHECKPOINT_SEC 300
+#define PIXEL_ADMIN_LIST_LIMIT 100
+#define PIXEL_ADMIN_NAMES_MAX 64
+#define PIXEL_ADMIN_WARM_THREADS 2
+#define PIXEL_CERT_STORE_MAGIC 0x53435850 /* "PXCS" */
+#define PIXEL_CERT_STORE_HEADROOM (4 << 20) /* bytes mapped past the end for appends */
+#define PIXEL_GEN_QUEUE_SIZE 128
+#define PIXEL_GEN_WORKERS_MAX 8
+#define PIXEL_GEN_NICE_IDLE 20     /* SCHED_IDLE instead of a nice level */
+#define PIXEL_GEN_KCC_REF 8        /* issuance rate halves at this many service threads */
+#define PIXEL_GEN_RATE_MIN 0.2     /* certs per second however busy */
+#define PIXEL_NEG_TBL_SIZE 64
+#define PIXEL_NEG_TTL_MISS 10 /* seconds. cert generation pending */
+#define PIXEL_NEG_TTL_ERR 300 /* seconds. cert on disk but not usable */
 #define PIXEL_TLS_EARLYDATA_SIZE 16384
+#define PIXEL_TICKET_KEYS 2
+#define PIXEL_TICKET_KEY_SIZE 32
+#define PIXEL_TICKET_ROTATE_SEC PIXEL_SSL_SESS_TIMEOUT /* a ticket stays decryptable for its lifetime */
 #ifndef DEFAULT_PEM_PATH
 #define DEFAULT_PEM_PATH "/opt/var/cache/pixelserv"
 #endif
 #define PIXELSERV_MAX_PATH 1024
 #define PIXELSERV_MAX_SERVER_NAME 255
+#define PIXEL_SSLCTX_BASE_SIZE 12288 /* rough bytes per cached SSL_CTX excl. cert and key */
+#define PIXEL_SSLCTX_EST_SIZE 16384 /* rough bytes per cached SSL_CTX incl. cert, key and CA chain */
 
 /* ECDHE-RSA-AES128-GCM-SHA256 :
    Android >= 4.4.2; Chrome >= 51; Firefox >= 49;
@@ -22,7 +60,7 @@
    IE 11 Win 7,8.1; IE 11 Winphone 8.1; Opera >= 17; Safar 7 iOS 7.1 */
 #define PIXELSERV_CIPHER_LIST \
   "ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES128-GCM-SHA256:" \
-  "ECDHE-RSA-AES128-SHA:DHE-RSA-AES128-SHA:AES128-SHA"
+  "ECDHE-RSA-AES128-SHA:ECDHE-ECDSA-AES128-SHA:DHE-RSA-AES128-SHA:AES128-SHA"
 
 #define PIXELSERV_TLSV1_3_CIPHERS \
   "TLS_CHACHA20_POLY1305_SHA256:TLS_AES_128_GCM_SHA256"
@@ -42,12 +80,18 @@ typedef enum {
     SSL_NOT_TLS,
     SSL_ERR,
     SSL_MISS,
+    SSL_DENY,
     SSL_HIT,
     SSL_HIT_CLS,
     SSL_HIT_RTT0,
     SSL_UNKNOWN
 } ssl_enum;
 
+typedef enum {
+    LEAF_KEY_RSA, /* RSA 1024 */
+    LEAF_KEY_EC   /* ECDSA P-256 */
+} leaf_key_enum;
+
 typedef struct {
     const char *tls_pem;
     const STACK_OF(X509_INFO) *cachain;
@@ -55,6 +99,8 @@ typedef struct {
     char server_ip[INET6_ADDRSTRLEN];
     ssl_enum status;
     int sslctx_idx;
+    int gen_wait; /* handshake suspended for inline cert generation */
+    char gen_cert[PIXELSERV_MAX_SERVER_NAME + 1]; /* cert name being generated */
 } tlsext_cb_arg_struct;
 
 typedef struct {
@@ -76,29 +122,198 @@ typedef struct {
     pthread_mutex_t lock;
 } sslctx_cache_struct;
 
+typedef struct {
+    char cert_name[PIXELSERV_MAX_SERVER_NAME + 1];
+    unsigned int expire; /* seconds since process up */
+    ssl_enum status; /* SSL_MISS or SSL_ERR */
+} neg_cache_struct;
+
+typedef struct name_node {
+    struct name_node *next;
+    unsigned int hash;
+    long val;
+    char name[];
+} name_node;
+
+typedef struct {
+    name_node **bucket;
+    unsigned int size; /* power of 2 */
+    int cnt;
+} name_tbl;
+
+typedef struct {
+    char name[PIXELSERV_MAX_SERVER_NAME + 1];
+    int prio; /* # of misses while queued */
+    unsigned int seq; /* arrival order */
+    struct timespec enq_time;
+} gen_queue_struct;
+
+typedef struct sess_entry {
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned int idlen;
+    SSL_SESSION *sess;
+    time_t expire;
+    int bytes;
+    struct sess_entry *hnext;           /* next in hash bucket */
+    struct sess_entry *prev, *next;     /* insertion order, oldest first */
+} sess_entry_struct;
+
+typedef struct {
+    pthread_mutex_t lock;
+    sess_entry_struct *bucket[PIXEL_SESS_BUCKETS];
+    sess_entry_struct *head, *tail;
+    int cnt, bytes;
+    int cnt_hit, cnt_miss, cnt_evict, cnt_expire;
+} sess_shard_struct;
+
+typedef struct {
+    unsigned char name[16];
+    unsigned char aes_key[PIXEL_TICKET_KEY_SIZE];
+    unsigned char hmac_key[PIXEL_TICKET_KEY_SIZE];
+} ticket_key_struct;
+
+typedef struct {
+    char *name;
+    int reuse_count;
+    time_t last_use;
+    int line; /* order in the prefetch file */
+} prefetch_struct;
+
+typedef struct {
+    char *name;
+    int hits;
+    unsigned int last_use; /* seconds since process up */
+    int bytes; /* estimate */
+    SSL_CTX *sslctx; /* up-ref'd until bytes is worked out */
+} cache_info_struct;
+
+typedef struct {
+    char *names; /* comma separated */
+    const char *pem_dir;
+    const STACK_OF(X509_INFO) *cachain;
+} cache_warm_struct;
+
+typedef struct {
+    time_t last; /* last handshake, or when first tracked */
+    unsigned int hits;
+} usage_struct;
+
+typedef struct der_cache_struct {
+    struct der_cache_struct *prev, *next;
+    const char *cert_name;
+    int cert_len;
+    int key_len;
+    int bytes; /* memory footprint incl. index */
+    unsigned char der[]; /* DER cert followed by DER private key */
+} der_cache_struct;
+
+typedef struct {
+    unsigned int magic;
+    unsigned int rec_len; /* incl. this header and padding to 8 bytes */
+    unsigned short name_len; /* incl. terminating NUL */
+    unsigned short cert_len;
+    unsigned short key_len;
+    unsigned short flags;
+    /* followed by name, DER cert and DER private key */
+} cert_store_rec;
+
+/* strings in one pool with a sorted index, for bsearch() */
+typedef struct {
+    char *pool;
+    char **items;
+    int cnt;
+} str_set;
+
+typedef struct {
+    char name[PIXEL_BUNDLE_NAME_MAX + 11]; /* "+NAME.HASH" */
+    char cn[PIXELSERV_MAX_SERVER_NAME + 1];
+    char *san; /* "DNS:a.com,DNS:*.a.com,..." */
+} bundle_struct;
+
 #define CONN_TLSTOR(p, e) ((conn_tlstor_struct*)p)->e
 
 void ssl_init_locks();
 void ssl_free_locks();
 void cert_tlstor_init(const char *pem_dir, cert_tlstor_t *c);
 void cert_tlstor_cleanup(cert_tlstor_t *c);
+void cert_idx_init(const char *pem_dir);
+void cert_idx_cleanup();
+int cert_store_open(const char *pem_dir);
+int cert_store_chown(uid_t uid, gid_t gid);
+void cert_store_close();
+int cert_store_import(const char *pem_dir);
+int cert_store_export(const char *pem_dir);
 void *cert_generator(void *ptr);
+void cert_gen_set_deadline(int msec);
+void cert_gen_set_workers(int workers);
+void cert_gen_set_budget(int nice, int rate);
+int cert_ctrl_open(const char *path);
+int dns_log_init(const char *file, const char *ip_addr);
+void *dns_log_watcher(void *ptr);
+void cert_ctrl_close();
+int cert_stage_init(int delay, const char *stage_dir, uid_t uid, gid_t gid);
+void cert_stage_save(const char *pem_dir);
+void cert_stage_cleanup();
+void usage_init(const char *pem_dir, int gc_days, int gc_archive);
+void usage_save(const char *pem_dir);
+void usage_cleanup();
+void cert_gen_set_key_type(leaf_key_enum type);
+int shared_key_init(const char *pem_dir);
+void shared_key_cleanup();
+int psl_init(const char *file);
+void psl_cleanup();
+int allowlist_init(char **files, int file_cnt);
+int allowlist_load();
+void allowlist_reload_request();
+void allowlist_cleanup();
+int bundle_init(const char *pem_dir);
+void bundle_cleanup();
+void key_pool_init(const char *pem_dir, int size, int serving);
+void key_pool_save(const char *pem_dir);
+void key_pool_cleanup();
 void sslctx_tbl_init(int tbl_size);
+void sslctx_tbl_set_auto(int target, int max_kb);
+void der_tbl_init(int max_kb);
+void der_tbl_cleanup();
+char* sslctx_tbl_get_mrc();
+char* cache_admin(char *query, const char *pem_dir, const STACK_OF(X509_INFO) *cachain);
 void sslctx_tbl_cleanup();
 void sslctx_tbl_load(const char* pem_dir, const STACK_OF(X509_INFO) *cachain);
 void sslctx_tbl_save(const char* pem_dir);
+void checkpoint_request();
 void run_benchmark(const cert_tlstor_t *ct, const char *cert);
+int cert_pregen(cert_tlstor_t *ct, char **files, int file_cnt);
 void sslctx_tbl_lock(int idx);
 void sslctx_tbl_unlock(int idx);
 int sslctx_tbl_get_cnt_total();
 int sslctx_tbl_get_cnt_hit();
 int sslctx_tbl_get_cnt_miss();
 int sslctx_tbl_get_cnt_purge();
+int der_tbl_get_cnt_total();
+int der_tbl_get_cnt_hit();
+int der_tbl_get_kb();
+int key_pool_get_cnt();
+int key_pool_get_cnt_empty();
+int key_pool_get_rate();
+int dns_log_get_cnt_warm();
+int dns_log_get_cnt_gen();
+int gen_budget_get_cnt_defer();
+int gen_budget_get_sec_defer();
+int cert_stage_get_cnt();
+int cert_stage_get_cnt_flushed();
+int usage_get_cnt();
+int usage_get_cnt_gc();
+int gen_queue_get_cnt();
+int gen_queue_get_lat_avg();
+int gen_queue_get_lat_max();
+int neg_tbl_get_cnt_miss();
+int neg_tbl_get_cnt_err();
 int sslctx_tbl_get_sess_cnt();
 int sslctx_tbl_get_sess_hit();
 int sslctx_tbl_get_sess_miss();
 int sslctx_tbl_get_sess_purge();
 SSL_CTX * create_default_sslctx(const char *pem_dir);
+void tls_count_resumption(SSL *ssl);
 int is_ssl_conn(int fd, char *srv_ip, int srv_ip_len, const int *ssl_ports, int num_ssl_ports);
 void conn_stor_init(int slots);
 void conn_stor_relinq(conn_tlstor_struct *p);
@@ -107,5 +322,6 @@ void conn_stor_flush();
 #ifdef TLS1_3_VERSION
 int tls_clienthello_cb(SSL *ssl, int *ad, void *arg);
 char* read_tls_early_data(SSL *ssl, int *err);
+int tls_resume_handshake(conn_tlstor_struct *c);
 #endif
 #endif
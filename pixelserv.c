@@ -7,6 +7,7 @@
 #include <fcntl.h>
 #include <pthread.h>
 #ifdef DROP_ROOT
+#include <grp.h>
 #include <pwd.h>
 #endif
 #ifdef TEST
@@ -46,9 +47,23 @@ int admin_port = 0;
 struct Global *g;
 cert_tlstor_t cert_tlstor;
 pthread_t certgen_thread;
+static int quit_pipe[2] = { -1, -1 }; /* SIGTERM wakes the main loop */
 
 void signal_handler(int sig)
 {
+  if (sig == SIGHUP) {
+    allowlist_reload_request();
+    return;
+  }
+  if (sig == SIGTERM) {
+    // Ignore this signal while we are quitting
+    signal(SIGTERM, SIG_IGN);
+    /* state is saved by the main loop on its way out, where taking locks
+       and doing I/O is safe */
+    if (write(quit_pipe[1], "q", 1) != 1)
+      _exit(EXIT_FAILURE);
+    return;
+  }
   if (sig != SIGTERM
    && sig != SIGUSR1
 #ifdef DEBUG
@@ -63,11 +78,6 @@ void signal_handler(int sig)
     log_msg(LGG_INFO, "Main process caught signal %d file %s", sig, __FILE__);
   } else {
 #endif
-    if (sig == SIGTERM) {
-      // Ignore this signal while we are quitting
-      signal(SIGTERM, SIG_IGN);
-    }
-
     conn_stor_flush();
 #if defined(__GLIBC__) && !defined(__UCLIBC__)
     malloc_trim(0);
@@ -78,12 +88,8 @@ void signal_handler(int sig)
     log_msg(LGG_CRIT, "%s", stats_string);
     free(stats_string);
 
-    sslctx_tbl_save(tls_pem);
-
-    if (sig == SIGTERM) {
-      log_msg(LGG_NOTICE, "exit on SIGTERM");
-      exit(EXIT_SUCCESS);
-    }
+    /* written by the checkpointer thread, not from here */
+    checkpoint_request();
 #ifdef DEBUG
   }
 #endif
@@ -137,6 +143,29 @@ int main (int argc, char* argv[])
 #endif //DEBUG
   int max_num_threads = DEFAULT_THREAD_MAX;
   int cert_cache_size = DEFAULT_CERT_CACHE_SIZE;
+  int cert_cache_target = 0;
+  int cert_cache_max_kb = DEFAULT_CERT_CACHE_MAX_KB;
+  int der_cache_kb = DEFAULT_DER_CACHE_KB;
+  int cert_gen_deadline = 0;
+  leaf_key_enum leaf_key_type = LEAF_KEY_RSA;
+  int key_pool_size = DEFAULT_KEY_POOL_SIZE;
+  int gen_workers = 0;
+  int gen_nice = DEFAULT_GEN_NICE;
+  int gen_rate = 0;
+  int use_shared_key = 0;
+  int use_store = 0;
+  char *store_cmd = NULL;
+  char *ctrl_sock = NULL;
+  char *psl_file = NULL;
+  char *dns_log_file = NULL;
+  int flush_delay = 0;
+  char *stage_dir = NULL;
+  int gc_days = 0;
+  int gc_archive = 0;
+  char *pregen_lists[MAX_BLOCKLISTS];
+  int num_pregen_lists = 0;
+  char *allow_lists[MAX_BLOCKLISTS];
+  int num_allow_lists = 0;
 
 #if defined(__GLIBC__) && !defined(__UCLIBC__)
   mallopt(M_ARENA_MAX, 1);
@@ -168,6 +197,12 @@ int main (int argc, char* argv[])
 #endif // !TEST
         case 'r': /* deprecated - ignoring */                 continue;
         case 'R': do_redirect = 1;                            continue;
+        case 'S': use_shared_key = 1;                         continue;
+        case 'Z':
+          use_store = 1;
+          if ((i + 1) < argc && (!strcmp(argv[i + 1], "import") || !strcmp(argv[i + 1], "export")))
+            store_cmd = argv[++i];
+          continue;
         // no default here because we want to move on to the next section
         case 'l':
           if ((i + 1) == argc || argv[i + 1][0] == '-') {
@@ -180,6 +215,12 @@ int main (int argc, char* argv[])
       if ((i + 1) < argc) {
         // switch on parameter letter and process subsequent argument
         switch (argv[i++][1]) {
+          case 'a':
+            if (num_allow_lists < MAX_BLOCKLISTS)
+              allow_lists[num_allow_lists++] = argv[i];
+            else
+              error = 1;
+          continue;
           case 'B':
             do_benchmark = 1;
             if (argv[i][0] == '-')
@@ -194,6 +235,76 @@ int main (int argc, char* argv[])
               error = 1;
             }
           continue;
+          case 'C': {
+            char *p = NULL;
+            errno = 0;
+            cert_cache_target = strtol(argv[i], &p, 10);
+            if (*p == ':')
+              cert_cache_max_kb = strtol(p + 1, &p, 10);
+            if (errno || *p != '\0' || cert_cache_target <= 0 || cert_cache_target >= 100
+                || cert_cache_max_kb <= 0) {
+              error = 1;
+            }
+          }
+          continue;
+          case 'd': dns_log_file = argv[i];                   continue;
+          case 'D':
+            errno = 0;
+            der_cache_kb = strtol(argv[i], NULL, 10);
+            if (errno || der_cache_kb < 0) {
+              error = 1;
+            }
+          continue;
+          case 'F': {
+            char *p = NULL;
+            errno = 0;
+            flush_delay = strtol(argv[i], &p, 10);
+            if (*p == ':' && p[1]) {
+              stage_dir = p + 1;
+              p += strlen(p);
+            }
+            /* no default STAGE_DIR: CERT_PATH is on the storage to spare
+               and a shared dir like /tmp is not safe to stage in */
+            if (errno || flush_delay < 0 || *p || (flush_delay > 0 && !stage_dir)) {
+              error = 1;
+            }
+          }
+          continue;
+          case 'g': {
+            char *p = NULL;
+            errno = 0;
+            gc_days = strtol(argv[i], &p, 10);
+            if (!strcmp(p, ":archive")) {
+              gc_archive = 1;
+              p += strlen(p);
+            }
+            if (errno || gc_days < 0 || *p) {
+              error = 1;
+            }
+          }
+          continue;
+          case 'G':
+            if (num_pregen_lists < MAX_BLOCKLISTS)
+              pregen_lists[num_pregen_lists++] = argv[i];
+            else
+              error = 1;
+          continue;
+          case 'i':
+            errno = 0;
+            cert_gen_deadline = strtol(argv[i], NULL, 10);
+            if (errno || cert_gen_deadline < 0) {
+              error = 1;
+            }
+          continue;
+          case 'K':
+            if (!strcmp(argv[i], "rsa"))
+              leaf_key_type = LEAF_KEY_RSA;
+            else if (!strcmp(argv[i], "ec"))
+              leaf_key_type = LEAF_KEY_EC;
+            else
+              error = 1;
+          continue;
+          case 'L': psl_file = argv[i];                       continue;
           case 'l':
             if ((logger_level)atoi(argv[i]) > LGG_DEBUG
                 || (logger_level)atoi(argv[i]) < 0)
@@ -210,6 +321,21 @@ int main (int argc, char* argv[])
           case 'o':
             log_msg(LGG_ERR, "'-o SELECT_TIMEOUT' is deprecated. will be removed in a future version");
           continue;
+          case 'N': {
+            char *p = NULL;
+            errno = 0;
+            if (!strncmp(argv[i], "idle", 4)) {
+              gen_nice = PIXEL_GEN_NICE_IDLE;
+              p = argv[i] + 4;
+            } else
+              gen_nice = strtol(argv[i], &p, 10);
+            if (p && *p == ':')
+              gen_rate = strtol(p + 1, &p, 10);
+            if (errno || gen_nice < 0 || gen_nice > PIXEL_GEN_NICE_IDLE || gen_rate < 0 || (p && *p)) {
+              error = 1;
+            }
+          }
+          continue;
           case 'O':
             errno = 0;
             http_keepalive = strtol(argv[i], NULL, 10);
@@ -236,6 +362,14 @@ int main (int argc, char* argv[])
               error = 1;
             }
           continue;
+          case 'P':
+            errno = 0;
+            key_pool_size = strtol(argv[i], NULL, 10);
+            if (errno || key_pool_size < 0) {
+              error = 1;
+            }
+          continue;
+          case 'Q': ctrl_sock = argv[i];                      continue;
           case 's': stats_url = argv[i];                      continue;
           case 't': stats_text_url = argv[i];                 continue;
           case 'T':
@@ -257,6 +391,13 @@ int main (int argc, char* argv[])
             }
           continue;
 #endif //DEBUG
+          case 'W':
+            errno = 0;
+            gen_workers = strtol(argv[i], NULL, 10);
+            if (errno || gen_workers <= 0 || gen_workers > PIXEL_GEN_WORKERS_MAX) {
+              error = 1;
+            }
+          continue;
           case 'z':
             tls_pem = argv[i];
           continue;
@@ -279,25 +420,39 @@ int main (int argc, char* argv[])
            "options:" "\n"
            "\t" "ip_addr/hostname\t(default: 0.0.0.0)" "\n"
            "\t" "-2\t\t\t(disable HTTP 204 reply to generate_204 URLs)" "\n"
+           "\t" "-a  BLOCKLIST\t\t(only generate certs for domains in hosts, dnsmasq or domain list; default: any)" "\n"
            "\t" "-A  ADMIN_PORT\t\t(HTTPS only. Default is none)" "\n"
            "\t" "-B  [CERT_FILE]\t\t(Benchmark crypto and disk then quit)" "\n"
            "\t" "-c  CERT_CACHE_SIZE\t(default: %d)" "\n"
+           "\t" "-C  HIT_PCT[:MAX_KB]\t(auto-size cert cache for HIT_PCT hit rate within MAX_KB; default: off)" "\n"
+           "\t" "-d  DNS_LOG\t\t(warm or generate certs for names in dnsmasq/unbound log; default: none)" "\n"
+           "\t" "-D  DER_CACHE_KB\t(second tier of cert cache; 0 to disable; default: %d)" "\n"
 #ifndef TEST
            "\t" "-f\t\t\t(stay in foreground/don't daemonize)" "\n"
 #endif // !TEST
+           "\t" "-F  FLUSH_DELAY:STAGE_DIR\t(stage new certs in STAGE_DIR in RAM, write to CERT_PATH after FLUSH_DELAY sec; default: 0 off)" "\n"
+           "\t" "-g  GC_DAYS[:archive]\t(delete or archive certs unused for GC_DAYS days; default: 0 off)" "\n"
+           "\t" "-G  BLOCKLIST\t\t(generate certs for all domains in hosts, dnsmasq or domain list then quit)" "\n"
+           "\t" "-i  GEN_WAIT_MSEC\t(hold handshakes of new domains until cert generated; default: 0 off)" "\n"
            "\t" "-k  HTTPS_PORT\t\t(default: "
            SECOND_PORT
            ")" "\n"
+           "\t" "-K  KEY_TYPE\t\t(key type of generated certs: rsa<default> or ec)" "\n"
+           "\t" "-L  PSL_FILE\t\t(Public Suffix List for naming wildcard certs; default: none)" "\n"
            "\t" "-l  LEVEL\t\t(0:critical 1:error<default> 2:warning 3:notice 4:info 5:debug)" "\n"
 #ifdef IF_MODE
            "\t" "-n  IFACE\t\t(default: all interfaces)" "\n"
 #endif // IF_MODE
            "\t" "-o  SELECT_TIMEOUT\t(deprecated; will be removed in a future version)" "\n"
+           "\t" "-N  NICE[:RATE]\t\t(nice level 0-19 or idle of cert generator, and max certs/s; default: %d, no max)" "\n"
            "\t" "-O  KEEPALIVE_TIME\t(for HTTP/1.1 connections; default: %ds)" "\n"
            "\t" "-p  HTTP_PORT\t\t(default: "
            DEFAULT_PORT
            ")" "\n"
+           "\t" "-P  KEY_POOL_SIZE\t(leaf keys generated ahead of time; 0 to disable; default: %d)" "\n"
+           "\t" "-Q  CTRL_SOCKET\t(unix datagram socket for queuing names for cert generation; default: none)" "\n"
            "\t" "-R\t\t\t(enable redirect to encoded path in URLs)" "\n"
+           "\t" "-S\t\t\t(use one leaf key stored in CERT_PATH for all generated certs)" "\n"
            "\t" "-s  STATS_HTML_URL\t(default: "
            DEFAULT_STATS_URL
            ")" "\n"
@@ -308,19 +463,21 @@ int main (int argc, char* argv[])
 #ifdef DROP_ROOT
            "\t" "-u  USER\t\t(default: \"nobody\")" "\n"
 #endif // DROP_ROOT
+           "\t" "-W  GEN_WORKERS\t\t(threads generating certs; 1 to %d; default: online CPUs up to %d)" "\n"
 #ifdef DEBUG
            "\t" "-w  warning_time\t(warn when elapsed connection time exceeds value in msec)" "\n"
 #endif //DEBUG
            "\t" "-z  CERT_PATH\t\t(default: "
            DEFAULT_PEM_PATH
            ")" "\n"
-           , VERSION, DEFAULT_CERT_CACHE_SIZE, DEFAULT_KEEPALIVE,
-           DEFAULT_THREAD_MAX);
+           "\t" "-Z  [import|export]\t(use single-file cert store in CERT_PATH; import/export PEM files then quit)" "\n"
+           , VERSION, DEFAULT_CERT_CACHE_SIZE, DEFAULT_DER_CACHE_KB, DEFAULT_GEN_NICE, DEFAULT_KEEPALIVE, DEFAULT_KEY_POOL_SIZE,
+           DEFAULT_THREAD_MAX, PIXEL_GEN_WORKERS_MAX, DEFAULT_GEN_WORKERS);
     exit(EXIT_FAILURE);
   }
 
 #ifndef TEST
-  if (!do_foreground && !do_benchmark && daemon(0, 0)) {
+  if (!do_foreground && !do_benchmark && !store_cmd && !num_pregen_lists && daemon(0, 0)) {
     log_msg(LGG_ERR, "failed to daemonize, exit: %m");
     exit(EXIT_FAILURE);
   }
@@ -334,39 +491,106 @@ int main (int argc, char* argv[])
 
   version_string = get_version(argc, argv);
   if (version_string) {
-      if (!do_benchmark) log_msg(LGG_CRIT, "%s", version_string);
+      if (!do_benchmark && !store_cmd && !num_pregen_lists) log_msg(LGG_CRIT, "%s", version_string);
     free(version_string);
   } else {
     exit(EXIT_FAILURE);
   }
 
-  mkfifo(PIXEL_CERT_PIPE, 0600);
+  if (ctrl_sock && !do_benchmark && !store_cmd && !num_pregen_lists && cert_ctrl_open(ctrl_sock) == 0) {
 #ifdef DROP_ROOT
-  pw = getpwnam(user);
-  if (chown(PIXEL_CERT_PIPE, pw->pw_uid, pw->pw_gid) < 0) {
-      log_msg(LGG_CRIT, "chown failed to set owner of %s to %s", PIXEL_CERT_PIPE, user);
-      exit(EXIT_FAILURE);
-  }
+    pw = getpwnam(user);
+    if (chown(ctrl_sock, pw->pw_uid, pw->pw_gid) < 0) {
+        log_msg(LGG_CRIT, "chown failed to set owner of %s to %s", ctrl_sock, user);
+        exit(EXIT_FAILURE);
+    }
 #endif
+  }
 
   SSL_library_init();
   ssl_init_locks();
   cert_tlstor_init(tls_pem, &cert_tlstor);
+  cert_idx_init(tls_pem);
+  if (psl_file)
+    psl_init(psl_file);
+  if (num_allow_lists)
+    allowlist_init(allow_lists, num_allow_lists);
+  bundle_init(tls_pem);
+  if (use_store && cert_store_open(tls_pem) < 0 && store_cmd)
+    exit(EXIT_FAILURE);
   sslctx_tbl_init(cert_cache_size);
+  if (cert_cache_target)
+    sslctx_tbl_set_auto(cert_cache_target, cert_cache_max_kb);
+  der_tbl_init(der_cache_kb);
+  cert_gen_set_deadline(cert_gen_deadline);
+  cert_gen_set_key_type(leaf_key_type);
+  if (gen_workers == 0) {
+    gen_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (gen_workers <= 0 || gen_workers > DEFAULT_GEN_WORKERS)
+      gen_workers = DEFAULT_GEN_WORKERS;
+  }
+  cert_gen_set_workers(gen_workers);
+  cert_gen_set_budget(gen_nice, gen_rate);
+  if (use_shared_key && shared_key_init(tls_pem) == 0)
+    key_pool_size = 0; /* no use for a key pool */
+  key_pool_init(tls_pem, key_pool_size, !do_benchmark && !store_cmd && !num_pregen_lists);
+  if (!do_benchmark && !store_cmd && !num_pregen_lists)
+    usage_init(tls_pem, gc_days, gc_archive);
+  if (!do_benchmark && !store_cmd && !num_pregen_lists) {
+    uid_t stage_uid = geteuid();
+    gid_t stage_gid = getegid();
+#ifdef DROP_ROOT
+    if ((pw = getpwnam(user)) != NULL) {
+      stage_uid = pw->pw_uid;
+      stage_gid = pw->pw_gid;
+    }
+#endif
+    cert_stage_init(flush_delay, stage_dir, stage_uid, stage_gid);
+  }
   conn_stor_init(max_num_threads);
 
-  sslctx_tbl_load(tls_pem, cert_tlstor.cachain);
   SSL_CTX *sslctx = create_default_sslctx(tls_pem);
 
-  if (do_benchmark) {
+  if (store_cmd) {
+    if (!strcmp(store_cmd, "import"))
+      cert_store_import(tls_pem);
+    else
+      cert_store_export(tls_pem);
+    goto quit_main;
+  } else if (do_benchmark) {
     run_benchmark(&cert_tlstor, bm_cert);
     goto quit_main;
+  } else if (num_pregen_lists) {
+#ifdef DROP_ROOT
+    /* files created here are read and rewritten by the daemon as user.
+       The store is opened already */
+    if ( (pw = getpwnam(user)) == NULL ) {
+      log_msg(LGG_WARNING, "Unknown user \"%s\"", user);
+    }
+    else if ( use_store && cert_store_chown(pw->pw_uid, pw->pw_gid) < 0 ) {
+      log_msg(LGG_WARNING, "chown failed to set owner of %s/%s to %s", tls_pem, PIXEL_CERT_STORE, user);
+    }
+    if ( pw && (initgroups(user, pw->pw_gid) || setgid(pw->pw_gid) || setuid(pw->pw_uid)) ) {
+      log_msg(LGG_WARNING, "setuid %d: %m", pw->pw_uid);
+    }
+#endif
+    cert_pregen(&cert_tlstor, pregen_lists, num_pregen_lists);
+    goto quit_main;
   } else {
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setstacksize(&attr, THREAD_STACK_SIZE);
     pthread_create(&certgen_thread, &attr, cert_generator, (void*)&cert_tlstor);
     pthread_attr_destroy(&attr);
+    if (dns_log_file && dns_log_init(dns_log_file, ip_addr) == 0) {
+      /* default stack: loads certs with create_child_sslctx() like the
+         other background threads */
+      pthread_t dns_log_thread;
+      pthread_attr_init(&attr);
+      pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+      pthread_create(&dns_log_thread, &attr, dns_log_watcher, (void*)&cert_tlstor);
+      pthread_attr_destroy(&attr);
+    }
   }
 
   memset(&hints, 0, sizeof hints);
@@ -440,6 +664,14 @@ int main (int argc, char* argv[])
   }
 
   // set up signal handling
+  if (pipe(quit_pipe) == -1) {
+    log_msg(LOG_ERR, "pipe() error: %m");
+    exit(EXIT_FAILURE);
+  }
+  FD_SET(quit_pipe[0], &readfds);
+  if (quit_pipe[0] > nfds) {
+    nfds = quit_pipe[0];
+  }
   {
     struct sigaction sa;
     memset(&sa, 0, sizeof(sa));
@@ -462,6 +694,11 @@ int main (int argc, char* argv[])
       log_msg(LOG_ERR, "SIGUSR1 %m");
       exit(EXIT_FAILURE);
     }
+    // set signal handler for reloading the allowlist
+    if (sigaction(SIGHUP, &sa, NULL)) {
+      log_msg(LOG_ERR, "SIGHUP %m");
+      exit(EXIT_FAILURE);
+    }
 #if defined(__GLIBC__) && defined(BACKTRACE)
     sa.sa_handler = print_trace;
     if (sigaction(SIGSEGV, &sa, NULL))
@@ -495,6 +732,9 @@ int main (int argc, char* argv[])
   }
 #endif
 
+  // listeners are up. warm up the cert cache in the background
+  sslctx_tbl_load(tls_pem, cert_tlstor.cachain);
+
   // cause failed pipe I/O calls to result in error return values instead of
   //  SIGPIPE signals
   signal(SIGPIPE, SIG_IGN);
@@ -562,6 +802,9 @@ int main (int argc, char* argv[])
       }
     }
 
+    if (FD_ISSET(quit_pipe[0], &selectfds))
+      break;
+
     // find first socket descriptor that is ready to read (if any)
     // note that even though multiple sockets may be ready, we only process one
     //  per loop iteration; subsequent ones will be handled on subsequent passes
@@ -612,6 +855,14 @@ int main (int argc, char* argv[])
           case SEND_POST:      ++pst; break;
           case SEND_HEAD:      ++hed; break;
           case SEND_OPTIONS:   ++opt; break;
+          case FAIL_HANDSHAKE:
+            switch (pipedata.ssl) {
+              case SSL_ERR:    ++sle; break;
+              case SSL_MISS:   ++slm; break;
+              case SSL_DENY:   ++sld; break;
+              default:         ++slu;
+            }
+            break;
           case ACTION_LOG_VERB:  log_set_verb(pipedata.verb); break;
           case ACTION_DEC_KCC: --kcc; break;
           default:
@@ -741,6 +992,7 @@ int main (int argc, char* argv[])
       t->cachain = cert_tlstor.cachain;
       t->status = SSL_UNKNOWN;
       t->sslctx_idx = -1;
+      t->gen_wait = 0;
 
       ssl = SSL_new(sslctx);
       SSL_set_fd(ssl, new_fd);
@@ -780,6 +1032,12 @@ redo_ssl_accept:
 
 skip_ssl_accept:
 
+      /* cert generation in progress. let the service thread resume the handshake */
+      if (sslerr == SSL_ERROR_WANT_CLIENT_HELLO_CB) {
+        conn_tlstor->early_data = NULL;
+        conn_tlstor->init_time = 0;
+        goto start_service_thread;
+      }
 #endif
       if (log_get_verb() >= LGG_WARNING && getnameinfo((struct sockaddr *)&their_addr, sin_size,
             ip_buf, sizeof ip_buf, port_buf, sizeof port_buf, NI_NUMERICHOST | NI_NUMERICSERV ) != 0) {
@@ -816,7 +1074,7 @@ skip_ssl_accept:
                       ip_buf, port_buf, t->servername);
                   break;
               case SSL_R_PARSE_TLSEXT:
-                  if (t->status == SSL_MISS)
+                  if (t->status == SSL_MISS || t->status == SSL_DENY)
                     break;
                   /* fall through */
               default:
@@ -829,7 +1087,7 @@ skip_ssl_accept:
         case SSL_ERROR_SYSCALL:
              /* OpenSSL 1.1.x clienthello will reach here
                 but we want to skip if it's known error such as missing certs */
-            if (t->status == SSL_MISS)
+            if (t->status == SSL_MISS || t->status == SSL_DENY)
               break;
 
             if (errno == 0 || errno == 104) {
@@ -851,6 +1109,7 @@ skip_ssl_accept:
       switch(t->status) {
         case SSL_ERR:        ++sle; break;
         case SSL_MISS:       ++slm; break;
+        case SSL_DENY:       ++sld; break;
         case SSL_HIT:
         case SSL_UNKNOWN:    ++slu; break;
         default:             ;
@@ -889,13 +1148,38 @@ start_service_thread:
       kmx = kcc;
   } // end of perpetual accept() loop
 
-  pthread_cancel(certgen_thread);
-  pthread_join(certgen_thread, NULL);
+  /* SIGTERM. Background threads still run and may hold locks for a while,
+     so only save state here and leave the tables alone */
+  {
+    char* stats_string = get_stats(0, 0);
+    log_msg(LGG_CRIT, "%s", stats_string);
+    free(stats_string);
+  }
+  sslctx_tbl_save(tls_pem);
+  key_pool_save(tls_pem);
+  cert_stage_save(tls_pem);
+  usage_save(tls_pem);
+  cert_ctrl_close();
+  log_msg(LGG_NOTICE, "exit on SIGTERM");
+  exit(EXIT_SUCCESS);
 
 quit_main:
   SSL_CTX_free(sslctx);
   conn_stor_flush();
   sslctx_tbl_cleanup();
+  der_tbl_cleanup();
+  cert_stage_save(tls_pem);
+  cert_stage_cleanup();
+  usage_save(tls_pem);
+  usage_cleanup();
+  key_pool_cleanup();
+  shared_key_cleanup();
+  cert_idx_cleanup();
+  bundle_cleanup();
+  allowlist_cleanup();
+  psl_cleanup();
+  cert_store_close();
+  cert_ctrl_close();
   cert_tlstor_cleanup(&cert_tlstor);
   ssl_free_locks();
   return (EXIT_SUCCESS);
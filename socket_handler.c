@@ -688,7 +688,21 @@ void* conn_handler( void *ptr )
   if (setsockopt(new_fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(struct timeval)) < 0)
     log_msg(LGG_DEBUG, "setsockopt(timeout) reported error: %m");
 
+#ifdef TLS1_3_VERSION
+  /* handshake suspended by tls_clienthello_cb while the cert is generated */
+  if (CONN_TLSTOR(ptr, ssl) && SSL_want_client_hello_cb(CONN_TLSTOR(ptr, ssl))
+      && tls_resume_handshake(ptr) < 0) {
+    ssl_enum status = CONN_TLSTOR(ptr, tlsext_cb_arg)->status;
+    pipedata.ssl = (status == SSL_MISS || status == SSL_ERR || status == SSL_DENY) ? status : SSL_UNKNOWN;
+    pipedata.status = FAIL_HANDSHAKE;
+    write_pipe(pipefd, &pipedata);
+    goto done_with_this_thread;
+  }
+#endif
+
   pipedata.ssl_ver = (CONN_TLSTOR(ptr, ssl)) ? SSL_version(CONN_TLSTOR(ptr, ssl)) : 0;
+  if (CONN_TLSTOR(ptr, ssl))
+    tls_count_resumption(CONN_TLSTOR(ptr, ssl));
   pipedata.run_time = CONN_TLSTOR(ptr, init_time);
   get_client_ip(new_fd, client_ip, sizeof client_ip, NULL, 0);
 
@@ -982,6 +996,41 @@ end_post:
             free(version_string);
             free(stat_string);
             response = aspbuf;
+          } else if (!strcmp(path, DEFAULT_MRC_URL) && CONN_TLSTOR(ptr, allow_admin)) {
+            pipedata.status = SEND_STATSTEXT;
+            stat_string = sslctx_tbl_get_mrc();
+            if (stat_string) {
+              rsize = asprintf(&aspbuf,
+                               "%s%u%s%s",
+                               txtstats1,
+                               (unsigned int)strlen(stat_string),
+                               txtstats2,
+                               stat_string);
+              free(stat_string);
+              response = aspbuf;
+            }
+          } else if (!strncmp(path, DEFAULT_CACHE_URL, strlen(DEFAULT_CACHE_URL))
+                     && (path[strlen(DEFAULT_CACHE_URL)] == '\0' || path[strlen(DEFAULT_CACHE_URL)] == '?')
+                     && CONN_TLSTOR(ptr, allow_admin)) {
+            char *query = path + strlen(DEFAULT_CACHE_URL);
+            char *decoded = malloc(strlen(query) + 1);
+            pipedata.status = SEND_STATSTEXT;
+            if (decoded) {
+              urldecode(decoded, (*query == '?') ? query + 1 : query);
+              stat_string = cache_admin(decoded, GLOBAL(g, pem_dir), CONN_TLSTOR(ptr, tlsext_cb_arg)->cachain);
+              free(decoded);
+            } else
+              stat_string = NULL;
+            if (stat_string) {
+              rsize = asprintf(&aspbuf,
+                               "%s%u%s%s",
+                               txtstats1,
+                               (unsigned int)strlen(stat_string),
+                               txtstats2,
+                               stat_string);
+              free(stat_string);
+              response = aspbuf;
+            }
           } else if (do_204 && (!strcasecmp(path, "/generate_204") || !strcasecmp(path, "/gen_204"))) {
             pipedata.status = SEND_204;
             response = http204;
@@ -1167,6 +1216,9 @@ end_post:
 
   } /* end of main event loop */
 
+#ifdef TLS1_3_VERSION
+done_with_this_thread:
+#endif
   /* done with the thread and let's finish with some house keeping */
   log_msg(LGG_DEBUG, "Exit recv loop socket:%d rv:%d errno:%d num_req:%d\n", new_fd, rv, errno, num_req);
 
@@ -33,6 +33,7 @@ typedef enum {
   SEND_POST,
   SEND_HEAD,
   SEND_OPTIONS,
+  FAIL_HANDSHAKE,
   ACTION_LOG_VERB,
   ACTION_DEC_KCC
 } response_enum;
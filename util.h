@@ -36,9 +36,16 @@
 #define DEFAULT_THREAD_MAX 1200 // maximum number of concurrent service threads
 #define DEFAULT_CERT_CACHE_SIZE 500
                                 // default number of certificates to be cached in memory
+#define DEFAULT_CERT_CACHE_MAX_KB 8192
+                                // default memory ceiling of cert cache in auto-size mode, in KB
+#define DEFAULT_DER_CACHE_KB 4096 // memory of the DER tier behind the cert cache, in KB
+#define DEFAULT_KEY_POOL_SIZE 8  // leaf keys generated ahead of new certs
+#define DEFAULT_GEN_WORKERS 4   // cert generator threads, capped by # of online CPUs
+#define DEFAULT_GEN_NICE 10     // nice level of cert generator threads
 #define SECOND_PORT "443"
 #define MAX_PORTS 10
 #define MAX_TLS_PORTS 9         // PLEASE ENSURE MAX_TLS_PORTS < MAX_PORTS
+#define MAX_BLOCKLISTS 8        // blocklists for each of -G and -a
 
 #ifdef DROP_ROOT
 # define DEFAULT_USER "nobody"  // nobody used by dnsmasq
@@ -46,6 +53,8 @@
 
 # define DEFAULT_STATS_URL "/servstats"
 # define DEFAULT_STATS_TEXT_URL "/servstats.txt"
+# define DEFAULT_MRC_URL "/servstats.mrc"
+# define DEFAULT_CACHE_URL "/servcache.txt"
 
 /* taken from glibc unistd.h and fixes musl */
 #ifndef TEMP_FAILURE_RETRY
@@ -111,6 +120,7 @@ extern volatile sig_atomic_t cly;
 extern volatile sig_atomic_t slh;
 extern volatile sig_atomic_t slm;
 extern volatile sig_atomic_t sle;
+extern volatile sig_atomic_t sld;
 extern volatile sig_atomic_t slc;
 extern volatile sig_atomic_t slu;
 extern volatile sig_atomic_t uca;